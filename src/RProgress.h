@@ -51,7 +51,8 @@ public:
            bool clear,
            double show_after) :
 
-	first(true), format(format), total(total), current(0), extra(0), count(0),
+	first(true), format(format), total(total), current(0), extra(0),
+	rate(0), eta(-1), count(0),
 	width(width), cursor_char(cursor_char), complete_char(complete_char),
 	incomplete_char(incomplete_char), clear(clear), show_after(show_after),
 	last_draw(""), start(0), toupdate(false), complete(false), reverse(false) {
@@ -68,7 +69,8 @@ public:
            bool clear = true,
            double show_after = 0.2) :
 
-	first(true), format(format), total(total), current(0), extra(0), count(0),
+	first(true), format(format), total(total), current(0), extra(0),
+	rate(0), eta(-1), count(0),
 	width(width), cursor_char(1, complete_char), complete_char(1, complete_char),
 	incomplete_char(1, incomplete_char), clear(clear), show_after(show_after),
 	last_draw(""), start(0), toupdate(false), complete(false), reverse(false) {
@@ -83,6 +85,8 @@ public:
 	void set_format(std::string format)    { this->format = format;         }
 	void set_total(double total)           { this->total = total;           }
 	void set_extra(int extra)              { this->extra = extra;           }
+	void set_rate(double rate)             { this->rate = rate;             }
+	void set_eta(double eta)               { this->eta = eta;               }
 	void set_width(int width)              { this->width = width;           }
 	void set_cursor_char(const char* cursor_char) {
 		this->cursor_char = cursor_char;
@@ -131,6 +135,8 @@ private:
 	double total;			// Total number of ticks
 	double current;		// Current number of ticks
 	int extra; // Extra statistics to display
+	double rate; // Bytes per second to display
+	double eta; // Seconds left, estimated from the ratio when negative
 	int count;                    // Total number of calls
 	int width;			// Width of progress bar
 	bool use_stderr;		// Whether to print to stderr
@@ -167,10 +173,13 @@ private:
 
 		// eta
 		double percent = round(ratio_now * 100);
-		double eta_secs = percent == 100 ? 0 :
+		double eta_secs = percent == 100 ? 0 : eta >= 0 ? eta :
 			elapsed_secs * (total / current - 1.0);
-		std::string eta = std::isinf(eta_secs) ? "?s" : vague_dt(eta_secs);
-		replace_all(str, ":eta", eta);
+		std::string eta_str = std::isinf(eta_secs) ? "?s" : vague_dt(eta_secs);
+		replace_all(str, ":eta", eta_str);
+
+		// rate
+		replace_all(str, ":rate", pretty_bytes(rate) + "/s");
 
 		// extra
 		buffer << std::setw(3) << extra << "%";
@@ -37,9 +37,18 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// bqs_codecs
+std::vector<std::string> bqs_codecs();
+RcppExport SEXP _bigrquerystorage_bqs_codecs() {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    rcpp_result_gen = Rcpp::wrap(bqs_codecs());
+    return rcpp_result_gen;
+END_RCPP
+}
 // bqs_client
-SEXP bqs_client(std::string client_info, std::string service_configuration, std::string refresh_token, std::string access_token, std::string root_certificate, std::string target);
-RcppExport SEXP _bigrquerystorage_bqs_client(SEXP client_infoSEXP, SEXP service_configurationSEXP, SEXP refresh_tokenSEXP, SEXP access_tokenSEXP, SEXP root_certificateSEXP, SEXP targetSEXP) {
+SEXP bqs_client(std::string client_info, std::string service_configuration, std::string refresh_token, std::string access_token, std::string root_certificate, std::string target, int channels, SEXP transport);
+RcppExport SEXP _bigrquerystorage_bqs_client(SEXP client_infoSEXP, SEXP service_configurationSEXP, SEXP refresh_tokenSEXP, SEXP access_tokenSEXP, SEXP root_certificateSEXP, SEXP targetSEXP, SEXP channelsSEXP, SEXP transportSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::traits::input_parameter< std::string >::type client_info(client_infoSEXP);
@@ -48,16 +57,139 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< std::string >::type access_token(access_tokenSEXP);
     Rcpp::traits::input_parameter< std::string >::type root_certificate(root_certificateSEXP);
     Rcpp::traits::input_parameter< std::string >::type target(targetSEXP);
-    rcpp_result_gen = Rcpp::wrap(bqs_client(client_info, service_configuration, refresh_token, access_token, root_certificate, target));
+    Rcpp::traits::input_parameter< int >::type channels(channelsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type transport(transportSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_client(client_info, service_configuration, refresh_token, access_token, root_certificate, target, channels, transport));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_insecure_client
+SEXP bqs_insecure_client(std::string client_info, std::string service_configuration, std::string target, int channels, SEXP transport);
+RcppExport SEXP _bigrquerystorage_bqs_insecure_client(SEXP client_infoSEXP, SEXP service_configurationSEXP, SEXP targetSEXP, SEXP channelsSEXP, SEXP transportSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< std::string >::type client_info(client_infoSEXP);
+    Rcpp::traits::input_parameter< std::string >::type service_configuration(service_configurationSEXP);
+    Rcpp::traits::input_parameter< std::string >::type target(targetSEXP);
+    Rcpp::traits::input_parameter< int >::type channels(channelsSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type transport(transportSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_insecure_client(client_info, service_configuration, target, channels, transport));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_client_token
+bool bqs_client_token(SEXP client, std::string access_token, double expires_in, SEXP refresh);
+RcppExport SEXP _bigrquerystorage_bqs_client_token(SEXP clientSEXP, SEXP access_tokenSEXP, SEXP expires_inSEXP, SEXP refreshSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type client(clientSEXP);
+    Rcpp::traits::input_parameter< std::string >::type access_token(access_tokenSEXP);
+    Rcpp::traits::input_parameter< double >::type expires_in(expires_inSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type refresh(refreshSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_client_token(client, access_token, expires_in, refresh));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_client_stats
+SEXP bqs_client_stats(SEXP client);
+RcppExport SEXP _bigrquerystorage_bqs_client_stats(SEXP clientSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type client(clientSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_client_stats(client));
     return rcpp_result_gen;
 END_RCPP
 }
 // bqs_ipc_stream
-SEXP bqs_ipc_stream(SEXP client, std::string project, std::string dataset, std::string table, std::string parent, std::int64_t n, std::vector<std::string> selected_fields, std::string row_restriction, std::double_t sample_percentage, std::int64_t timestamp_seconds, std::int32_t timestamp_nanos, bool quiet);
-RcppExport SEXP _bigrquerystorage_bqs_ipc_stream(SEXP clientSEXP, SEXP projectSEXP, SEXP datasetSEXP, SEXP tableSEXP, SEXP parentSEXP, SEXP nSEXP, SEXP selected_fieldsSEXP, SEXP row_restrictionSEXP, SEXP sample_percentageSEXP, SEXP timestamp_secondsSEXP, SEXP timestamp_nanosSEXP, SEXP quietSEXP) {
+SEXP bqs_ipc_stream(SEXP client, std::string project, std::string dataset, std::string table, std::string parent, std::int64_t n, std::vector<std::string> selected_fields, std::string row_restriction, std::double_t sample_percentage, std::int64_t timestamp_seconds, std::int32_t timestamp_nanos, bool quiet, int threads, bool ordered, std::int32_t max_stream_count, std::int32_t preferred_min_stream_count, std::string compression, std::string response_compression, std::double_t memory_limit, std::string cache_dir);
+RcppExport SEXP _bigrquerystorage_bqs_ipc_stream(SEXP clientSEXP, SEXP projectSEXP, SEXP datasetSEXP, SEXP tableSEXP, SEXP parentSEXP, SEXP nSEXP, SEXP selected_fieldsSEXP, SEXP row_restrictionSEXP, SEXP sample_percentageSEXP, SEXP timestamp_secondsSEXP, SEXP timestamp_nanosSEXP, SEXP quietSEXP, SEXP threadsSEXP, SEXP orderedSEXP, SEXP max_stream_countSEXP, SEXP preferred_min_stream_countSEXP, SEXP compressionSEXP, SEXP response_compressionSEXP, SEXP memory_limitSEXP, SEXP cache_dirSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type client(clientSEXP);
+    Rcpp::traits::input_parameter< std::string >::type project(projectSEXP);
+    Rcpp::traits::input_parameter< std::string >::type dataset(datasetSEXP);
+    Rcpp::traits::input_parameter< std::string >::type table(tableSEXP);
+    Rcpp::traits::input_parameter< std::string >::type parent(parentSEXP);
+    Rcpp::traits::input_parameter< std::int64_t >::type n(nSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type selected_fields(selected_fieldsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type row_restriction(row_restrictionSEXP);
+    Rcpp::traits::input_parameter< std::double_t >::type sample_percentage(sample_percentageSEXP);
+    Rcpp::traits::input_parameter< std::int64_t >::type timestamp_seconds(timestamp_secondsSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type timestamp_nanos(timestamp_nanosSEXP);
+    Rcpp::traits::input_parameter< bool >::type quiet(quietSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type ordered(orderedSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type max_stream_count(max_stream_countSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type preferred_min_stream_count(preferred_min_stream_countSEXP);
+    Rcpp::traits::input_parameter< std::string >::type compression(compressionSEXP);
+    Rcpp::traits::input_parameter< std::string >::type response_compression(response_compressionSEXP);
+    Rcpp::traits::input_parameter< std::double_t >::type memory_limit(memory_limitSEXP);
+    Rcpp::traits::input_parameter< std::string >::type cache_dir(cache_dirSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_ipc_stream(client, project, dataset, table, parent, n, selected_fields, row_restriction, sample_percentage, timestamp_seconds, timestamp_nanos, quiet, threads, ordered, max_stream_count, preferred_min_stream_count, compression, response_compression, memory_limit, cache_dir));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_ipc_tables
+SEXP bqs_ipc_tables(SEXP client, std::vector<std::string> projects, std::vector<std::string> datasets, std::vector<std::string> tables, std::string parent, std::int64_t n, std::vector<std::string> selected_fields, std::string row_restriction, std::double_t sample_percentage, std::int64_t timestamp_seconds, std::int32_t timestamp_nanos, bool quiet, int threads, bool ordered, std::int32_t max_stream_count, std::int32_t preferred_min_stream_count, std::string compression, std::string response_compression, std::double_t memory_limit);
+RcppExport SEXP _bigrquerystorage_bqs_ipc_tables(SEXP clientSEXP, SEXP projectsSEXP, SEXP datasetsSEXP, SEXP tablesSEXP, SEXP parentSEXP, SEXP nSEXP, SEXP selected_fieldsSEXP, SEXP row_restrictionSEXP, SEXP sample_percentageSEXP, SEXP timestamp_secondsSEXP, SEXP timestamp_nanosSEXP, SEXP quietSEXP, SEXP threadsSEXP, SEXP orderedSEXP, SEXP max_stream_countSEXP, SEXP preferred_min_stream_countSEXP, SEXP compressionSEXP, SEXP response_compressionSEXP, SEXP memory_limitSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type client(clientSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type projects(projectsSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type datasets(datasetsSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type tables(tablesSEXP);
+    Rcpp::traits::input_parameter< std::string >::type parent(parentSEXP);
+    Rcpp::traits::input_parameter< std::int64_t >::type n(nSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type selected_fields(selected_fieldsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type row_restriction(row_restrictionSEXP);
+    Rcpp::traits::input_parameter< std::double_t >::type sample_percentage(sample_percentageSEXP);
+    Rcpp::traits::input_parameter< std::int64_t >::type timestamp_seconds(timestamp_secondsSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type timestamp_nanos(timestamp_nanosSEXP);
+    Rcpp::traits::input_parameter< bool >::type quiet(quietSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type ordered(orderedSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type max_stream_count(max_stream_countSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type preferred_min_stream_count(preferred_min_stream_countSEXP);
+    Rcpp::traits::input_parameter< std::string >::type compression(compressionSEXP);
+    Rcpp::traits::input_parameter< std::string >::type response_compression(response_compressionSEXP);
+    Rcpp::traits::input_parameter< std::double_t >::type memory_limit(memory_limitSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_ipc_tables(client, projects, datasets, tables, parent, n, selected_fields, row_restriction, sample_percentage, timestamp_seconds, timestamp_nanos, quiet, threads, ordered, max_stream_count, preferred_min_stream_count, compression, response_compression, memory_limit));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_batch_stream
+void bqs_batch_stream(SEXP client, SEXP stream, std::string project, std::string dataset, std::string table, std::string parent, std::int64_t n, std::vector<std::string> selected_fields, std::string row_restriction, std::double_t sample_percentage, std::int64_t timestamp_seconds, std::int32_t timestamp_nanos, int threads, std::int32_t max_stream_count, std::int32_t preferred_min_stream_count, std::string compression, std::string response_compression, std::double_t read_ahead);
+RcppExport SEXP _bigrquerystorage_bqs_batch_stream(SEXP clientSEXP, SEXP streamSEXP, SEXP projectSEXP, SEXP datasetSEXP, SEXP tableSEXP, SEXP parentSEXP, SEXP nSEXP, SEXP selected_fieldsSEXP, SEXP row_restrictionSEXP, SEXP sample_percentageSEXP, SEXP timestamp_secondsSEXP, SEXP timestamp_nanosSEXP, SEXP threadsSEXP, SEXP max_stream_countSEXP, SEXP preferred_min_stream_countSEXP, SEXP compressionSEXP, SEXP response_compressionSEXP, SEXP read_aheadSEXP) {
+BEGIN_RCPP
+    Rcpp::traits::input_parameter< SEXP >::type client(clientSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type stream(streamSEXP);
+    Rcpp::traits::input_parameter< std::string >::type project(projectSEXP);
+    Rcpp::traits::input_parameter< std::string >::type dataset(datasetSEXP);
+    Rcpp::traits::input_parameter< std::string >::type table(tableSEXP);
+    Rcpp::traits::input_parameter< std::string >::type parent(parentSEXP);
+    Rcpp::traits::input_parameter< std::int64_t >::type n(nSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type selected_fields(selected_fieldsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type row_restriction(row_restrictionSEXP);
+    Rcpp::traits::input_parameter< std::double_t >::type sample_percentage(sample_percentageSEXP);
+    Rcpp::traits::input_parameter< std::int64_t >::type timestamp_seconds(timestamp_secondsSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type timestamp_nanos(timestamp_nanosSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type max_stream_count(max_stream_countSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type preferred_min_stream_count(preferred_min_stream_countSEXP);
+    Rcpp::traits::input_parameter< std::string >::type compression(compressionSEXP);
+    Rcpp::traits::input_parameter< std::string >::type response_compression(response_compressionSEXP);
+    Rcpp::traits::input_parameter< std::double_t >::type read_ahead(read_aheadSEXP);
+    bqs_batch_stream(client, stream, project, dataset, table, parent, n, selected_fields, row_restriction, sample_percentage, timestamp_seconds, timestamp_nanos, threads, max_stream_count, preferred_min_stream_count, compression, response_compression, read_ahead);
+    return R_NilValue;
+END_RCPP
+}
+// bqs_ipc_file
+double bqs_ipc_file(SEXP client, std::string path, std::string project, std::string dataset, std::string table, std::string parent, std::int64_t n, std::vector<std::string> selected_fields, std::string row_restriction, std::double_t sample_percentage, std::int64_t timestamp_seconds, std::int32_t timestamp_nanos, bool quiet, int threads, std::int32_t max_stream_count, std::int32_t preferred_min_stream_count, std::string compression, std::string response_compression, std::double_t read_ahead);
+RcppExport SEXP _bigrquerystorage_bqs_ipc_file(SEXP clientSEXP, SEXP pathSEXP, SEXP projectSEXP, SEXP datasetSEXP, SEXP tableSEXP, SEXP parentSEXP, SEXP nSEXP, SEXP selected_fieldsSEXP, SEXP row_restrictionSEXP, SEXP sample_percentageSEXP, SEXP timestamp_secondsSEXP, SEXP timestamp_nanosSEXP, SEXP quietSEXP, SEXP threadsSEXP, SEXP max_stream_countSEXP, SEXP preferred_min_stream_countSEXP, SEXP compressionSEXP, SEXP response_compressionSEXP, SEXP read_aheadSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::traits::input_parameter< SEXP >::type client(clientSEXP);
+    Rcpp::traits::input_parameter< std::string >::type path(pathSEXP);
     Rcpp::traits::input_parameter< std::string >::type project(projectSEXP);
     Rcpp::traits::input_parameter< std::string >::type dataset(datasetSEXP);
     Rcpp::traits::input_parameter< std::string >::type table(tableSEXP);
@@ -69,7 +201,129 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< std::int64_t >::type timestamp_seconds(timestamp_secondsSEXP);
     Rcpp::traits::input_parameter< std::int32_t >::type timestamp_nanos(timestamp_nanosSEXP);
     Rcpp::traits::input_parameter< bool >::type quiet(quietSEXP);
-    rcpp_result_gen = Rcpp::wrap(bqs_ipc_stream(client, project, dataset, table, parent, n, selected_fields, row_restriction, sample_percentage, timestamp_seconds, timestamp_nanos, quiet));
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type max_stream_count(max_stream_countSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type preferred_min_stream_count(preferred_min_stream_countSEXP);
+    Rcpp::traits::input_parameter< std::string >::type compression(compressionSEXP);
+    Rcpp::traits::input_parameter< std::string >::type response_compression(response_compressionSEXP);
+    Rcpp::traits::input_parameter< std::double_t >::type read_ahead(read_aheadSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_ipc_file(client, path, project, dataset, table, parent, n, selected_fields, row_restriction, sample_percentage, timestamp_seconds, timestamp_nanos, quiet, threads, max_stream_count, preferred_min_stream_count, compression, response_compression, read_ahead));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_download_start
+SEXP bqs_download_start(SEXP client, std::string project, std::string dataset, std::string table, std::string parent, std::int64_t n, std::vector<std::string> selected_fields, std::string row_restriction, std::double_t sample_percentage, std::int64_t timestamp_seconds, std::int32_t timestamp_nanos, int threads, bool ordered, std::int32_t max_stream_count, std::int32_t preferred_min_stream_count, std::string compression, std::string response_compression);
+RcppExport SEXP _bigrquerystorage_bqs_download_start(SEXP clientSEXP, SEXP projectSEXP, SEXP datasetSEXP, SEXP tableSEXP, SEXP parentSEXP, SEXP nSEXP, SEXP selected_fieldsSEXP, SEXP row_restrictionSEXP, SEXP sample_percentageSEXP, SEXP timestamp_secondsSEXP, SEXP timestamp_nanosSEXP, SEXP threadsSEXP, SEXP orderedSEXP, SEXP max_stream_countSEXP, SEXP preferred_min_stream_countSEXP, SEXP compressionSEXP, SEXP response_compressionSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type client(clientSEXP);
+    Rcpp::traits::input_parameter< std::string >::type project(projectSEXP);
+    Rcpp::traits::input_parameter< std::string >::type dataset(datasetSEXP);
+    Rcpp::traits::input_parameter< std::string >::type table(tableSEXP);
+    Rcpp::traits::input_parameter< std::string >::type parent(parentSEXP);
+    Rcpp::traits::input_parameter< std::int64_t >::type n(nSEXP);
+    Rcpp::traits::input_parameter< std::vector<std::string> >::type selected_fields(selected_fieldsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type row_restriction(row_restrictionSEXP);
+    Rcpp::traits::input_parameter< std::double_t >::type sample_percentage(sample_percentageSEXP);
+    Rcpp::traits::input_parameter< std::int64_t >::type timestamp_seconds(timestamp_secondsSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type timestamp_nanos(timestamp_nanosSEXP);
+    Rcpp::traits::input_parameter< int >::type threads(threadsSEXP);
+    Rcpp::traits::input_parameter< bool >::type ordered(orderedSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type max_stream_count(max_stream_countSEXP);
+    Rcpp::traits::input_parameter< std::int32_t >::type preferred_min_stream_count(preferred_min_stream_countSEXP);
+    Rcpp::traits::input_parameter< std::string >::type compression(compressionSEXP);
+    Rcpp::traits::input_parameter< std::string >::type response_compression(response_compressionSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_download_start(client, project, dataset, table, parent, n, selected_fields, row_restriction, sample_percentage, timestamp_seconds, timestamp_nanos, threads, ordered, max_stream_count, preferred_min_stream_count, compression, response_compression));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_download_done
+bool bqs_download_done(SEXP download);
+RcppExport SEXP _bigrquerystorage_bqs_download_done(SEXP downloadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type download(downloadSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_download_done(download));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_download_progress
+double bqs_download_progress(SEXP download);
+RcppExport SEXP _bigrquerystorage_bqs_download_progress(SEXP downloadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type download(downloadSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_download_progress(download));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_download_cancel
+void bqs_download_cancel(SEXP download);
+RcppExport SEXP _bigrquerystorage_bqs_download_cancel(SEXP downloadSEXP) {
+BEGIN_RCPP
+    Rcpp::traits::input_parameter< SEXP >::type download(downloadSEXP);
+    bqs_download_cancel(download);
+    return R_NilValue;
+END_RCPP
+}
+// bqs_download_value
+SEXP bqs_download_value(SEXP download);
+RcppExport SEXP _bigrquerystorage_bqs_download_value(SEXP downloadSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type download(downloadSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_download_value(download));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_mock_server
+SEXP bqs_mock_server(int streams, std::int64_t rows, std::int64_t page_rows, double latency_ms, double throttle_percent, int errors, std::string error_code);
+RcppExport SEXP _bigrquerystorage_bqs_mock_server(SEXP streamsSEXP, SEXP rowsSEXP, SEXP page_rowsSEXP, SEXP latency_msSEXP, SEXP throttle_percentSEXP, SEXP errorsSEXP, SEXP error_codeSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< int >::type streams(streamsSEXP);
+    Rcpp::traits::input_parameter< std::int64_t >::type rows(rowsSEXP);
+    Rcpp::traits::input_parameter< std::int64_t >::type page_rows(page_rowsSEXP);
+    Rcpp::traits::input_parameter< double >::type latency_ms(latency_msSEXP);
+    Rcpp::traits::input_parameter< double >::type throttle_percent(throttle_percentSEXP);
+    Rcpp::traits::input_parameter< int >::type errors(errorsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type error_code(error_codeSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_mock_server(streams, rows, page_rows, latency_ms, throttle_percent, errors, error_code));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_mock_stop
+void bqs_mock_stop(SEXP server);
+RcppExport SEXP _bigrquerystorage_bqs_mock_stop(SEXP serverSEXP) {
+BEGIN_RCPP
+    Rcpp::traits::input_parameter< SEXP >::type server(serverSEXP);
+    bqs_mock_stop(server);
+    return R_NilValue;
+END_RCPP
+}
+// bqs_postprocess
+SEXP bqs_postprocess(SEXP df, SEXP fields, std::string bigint);
+RcppExport SEXP _bigrquerystorage_bqs_postprocess(SEXP dfSEXP, SEXP fieldsSEXP, SEXP bigintSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type df(dfSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type fields(fieldsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type bigint(bigintSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_postprocess(df, fields, bigint));
+    return rcpp_result_gen;
+END_RCPP
+}
+// bqs_convert_columns
+SEXP bqs_convert_columns(SEXP schema, SEXP batches, SEXP fields, std::string bigint, std::string decimal);
+RcppExport SEXP _bigrquerystorage_bqs_convert_columns(SEXP schemaSEXP, SEXP batchesSEXP, SEXP fieldsSEXP, SEXP bigintSEXP, SEXP decimalSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::traits::input_parameter< SEXP >::type schema(schemaSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type batches(batchesSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type fields(fieldsSEXP);
+    Rcpp::traits::input_parameter< std::string >::type bigint(bigintSEXP);
+    Rcpp::traits::input_parameter< std::string >::type decimal(decimalSEXP);
+    rcpp_result_gen = Rcpp::wrap(bqs_convert_columns(schema, batches, fields, bigint, decimal));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -78,12 +332,30 @@ static const R_CallMethodDef CallEntries[] = {
     {"_bigrquerystorage_bqs_set_log_verbosity", (DL_FUNC) &_bigrquerystorage_bqs_set_log_verbosity, 1},
     {"_bigrquerystorage_bqs_init_logger", (DL_FUNC) &_bigrquerystorage_bqs_init_logger, 0},
     {"_bigrquerystorage_grpc_version", (DL_FUNC) &_bigrquerystorage_grpc_version, 0},
-    {"_bigrquerystorage_bqs_client", (DL_FUNC) &_bigrquerystorage_bqs_client, 6},
-    {"_bigrquerystorage_bqs_ipc_stream", (DL_FUNC) &_bigrquerystorage_bqs_ipc_stream, 12},
+    {"_bigrquerystorage_bqs_codecs", (DL_FUNC) &_bigrquerystorage_bqs_codecs, 0},
+    {"_bigrquerystorage_bqs_client", (DL_FUNC) &_bigrquerystorage_bqs_client, 8},
+    {"_bigrquerystorage_bqs_insecure_client", (DL_FUNC) &_bigrquerystorage_bqs_insecure_client, 5},
+    {"_bigrquerystorage_bqs_client_token", (DL_FUNC) &_bigrquerystorage_bqs_client_token, 4},
+    {"_bigrquerystorage_bqs_client_stats", (DL_FUNC) &_bigrquerystorage_bqs_client_stats, 1},
+    {"_bigrquerystorage_bqs_ipc_stream", (DL_FUNC) &_bigrquerystorage_bqs_ipc_stream, 20},
+    {"_bigrquerystorage_bqs_ipc_tables", (DL_FUNC) &_bigrquerystorage_bqs_ipc_tables, 19},
+    {"_bigrquerystorage_bqs_batch_stream", (DL_FUNC) &_bigrquerystorage_bqs_batch_stream, 18},
+    {"_bigrquerystorage_bqs_ipc_file", (DL_FUNC) &_bigrquerystorage_bqs_ipc_file, 19},
+    {"_bigrquerystorage_bqs_download_start", (DL_FUNC) &_bigrquerystorage_bqs_download_start, 17},
+    {"_bigrquerystorage_bqs_download_done", (DL_FUNC) &_bigrquerystorage_bqs_download_done, 1},
+    {"_bigrquerystorage_bqs_download_progress", (DL_FUNC) &_bigrquerystorage_bqs_download_progress, 1},
+    {"_bigrquerystorage_bqs_download_cancel", (DL_FUNC) &_bigrquerystorage_bqs_download_cancel, 1},
+    {"_bigrquerystorage_bqs_download_value", (DL_FUNC) &_bigrquerystorage_bqs_download_value, 1},
+    {"_bigrquerystorage_bqs_mock_server", (DL_FUNC) &_bigrquerystorage_bqs_mock_server, 7},
+    {"_bigrquerystorage_bqs_mock_stop", (DL_FUNC) &_bigrquerystorage_bqs_mock_stop, 1},
+    {"_bigrquerystorage_bqs_postprocess", (DL_FUNC) &_bigrquerystorage_bqs_postprocess, 3},
+    {"_bigrquerystorage_bqs_convert_columns", (DL_FUNC) &_bigrquerystorage_bqs_convert_columns, 5},
     {NULL, NULL, 0}
 };
 
+void bqs_init_cache(DllInfo* dll);
 RcppExport void R_init_bigrquerystorage(DllInfo *dll) {
     R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
     R_useDynamicSymbols(dll, FALSE);
+    bqs_init_cache(dll);
 }
@@ -0,0 +1,1218 @@
+/* -*- mode: c++ -*- */
+
+// Minimal reader and writer for the Arrow IPC messages served by the
+// BigQuery Storage API. Only the parts of the flatbuffers format needed to
+// rewrite record batch metadata and to hand record batches over through the
+// Arrow C data interface are implemented.
+
+#ifndef ARROW_IPC_H
+#define ARROW_IPC_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "codec.h"
+
+// Arrow C data and stream interfaces
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  const char* format;
+  const char* name;
+  const char* metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema** children;
+  struct ArrowSchema* dictionary;
+  void (*release)(struct ArrowSchema*);
+  void* private_data;
+};
+
+struct ArrowArray {
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void** buffers;
+  struct ArrowArray** children;
+  struct ArrowArray* dictionary;
+  void (*release)(struct ArrowArray*);
+  void* private_data;
+};
+
+#endif
+
+#ifndef ARROW_C_STREAM_INTERFACE
+#define ARROW_C_STREAM_INTERFACE
+
+struct ArrowArrayStream {
+  int (*get_schema)(struct ArrowArrayStream*, struct ArrowSchema* out);
+  int (*get_next)(struct ArrowArrayStream*, struct ArrowArray* out);
+  const char* (*get_last_error)(struct ArrowArrayStream*);
+  void (*release)(struct ArrowArrayStream*);
+  void* private_data;
+};
+
+#endif
+
+namespace arrow_ipc {
+
+// Message.fbs field slots
+const int message_version = 0;
+const int message_header_type = 1;
+const int message_header = 2;
+const int message_body_length = 3;
+const std::uint8_t header_schema = 1;
+const std::uint8_t header_record_batch = 3;
+
+const int record_batch_length = 0;
+const int record_batch_nodes = 1;
+const int record_batch_buffers = 2;
+const int record_batch_compression = 3;
+const int record_batch_variadic_counts = 4;
+
+const int body_compression_codec = 0;
+
+// Schema.fbs field slots
+const int schema_fields = 1;
+
+const int field_name = 0;
+const int field_nullable = 1;
+const int field_type_type = 2;
+const int field_type = 3;
+const int field_children = 5;
+const int field_custom_metadata = 6;
+
+const int key_value_key = 0;
+const int key_value_value = 1;
+
+const int int_bit_width = 0;
+const int int_is_signed = 1;
+const int floating_point_precision = 0;
+const int decimal_precision = 0;
+const int decimal_scale = 1;
+const int decimal_bit_width = 2;
+const int date_unit = 0;
+const int time_unit = 0;
+const int timestamp_unit = 0;
+const int timestamp_timezone = 1;
+const int interval_unit = 0;
+const int duration_unit = 0;
+const int fixed_size_binary_byte_width = 0;
+const int fixed_size_list_list_size = 0;
+const int map_keys_sorted = 0;
+
+// Schema.fbs units used when the field is absent, MILLISECOND
+const std::int16_t date_unit_default = 1;
+const std::int16_t time_unit_default = 1;
+const std::int16_t duration_unit_default = 1;
+
+// Schema.fbs Type union
+enum Type {
+  type_none = 0, type_null = 1, type_int = 2, type_floating_point = 3,
+  type_binary = 4, type_utf8 = 5, type_bool = 6, type_decimal = 7,
+  type_date = 8, type_time = 9, type_timestamp = 10, type_interval = 11,
+  type_list = 12, type_struct = 13, type_union = 14,
+  type_fixed_size_binary = 15, type_fixed_size_list = 16, type_map = 17,
+  type_duration = 18, type_large_binary = 19, type_large_utf8 = 20,
+  type_large_list = 21
+};
+
+// File.fbs field slots
+const int footer_version = 0;
+const int footer_schema = 1;
+const int footer_dictionaries = 2;
+const int footer_record_batches = 3;
+
+const std::uint32_t continuation = 0xFFFFFFFF;
+
+inline void invalid() {
+  throw std::runtime_error("Invalid Arrow IPC message.");
+}
+
+template <typename T>
+T read(const std::uint8_t* data) {
+  T value;
+  std::memcpy(&value, data, sizeof(T));
+  return value;
+}
+
+inline std::size_t pad8(std::size_t size) {
+  return (size + 7) & ~std::size_t(7);
+}
+
+// -- Flatbuffers reader -------------------------------------------------------
+
+class Table {
+public:
+  Table(const std::uint8_t* data, std::size_t size, std::size_t pos)
+    : data_(data), size_(size), pos_(pos) {
+    if (pos_ + 4 > size_) invalid();
+    std::int64_t vtable = std::int64_t(pos_) - read<std::int32_t>(data_ + pos_);
+    if (vtable < 0 || std::size_t(vtable) + 4 > size_) invalid();
+    vtable_ = std::size_t(vtable);
+    vtable_size_ = read<std::uint16_t>(data_ + vtable_);
+    if (vtable_ + vtable_size_ > size_) invalid();
+  }
+
+  // Root table of a flatbuffer
+  static Table Root(const std::uint8_t* data, std::size_t size) {
+    if (size < 4) invalid();
+    return Table(data, size, read<std::uint32_t>(data));
+  }
+
+  // Absolute position of a field, 0 when absent
+  std::size_t Field(int slot) const {
+    std::size_t entry = 4 + 2 * std::size_t(slot);
+    if (entry + 2 > vtable_size_) return 0;
+    std::uint16_t offset = read<std::uint16_t>(data_ + vtable_ + entry);
+    return offset == 0 ? 0 : pos_ + offset;
+  }
+
+  bool Has(int slot) const { return Field(slot) != 0; }
+
+  template <typename T>
+  T Scalar(int slot, T def) const {
+    std::size_t field = Field(slot);
+    if (field == 0) return def;
+    if (field + sizeof(T) > size_) invalid();
+    return read<T>(data_ + field);
+  }
+
+  // Follow an offset field to its target position
+  std::size_t Target(int slot) const {
+    std::size_t field = Field(slot);
+    if (field == 0 || field + 4 > size_) invalid();
+    std::size_t target = field + read<std::uint32_t>(data_ + field);
+    if (target >= size_) invalid();
+    return target;
+  }
+
+  Table Child(int slot) const {
+    return Table(data_, size_, Target(slot));
+  }
+
+  // Vector field, returns the position of its first element
+  std::size_t Vector(int slot, std::uint32_t* count,
+                     std::size_t element_size) const {
+    std::size_t target = Target(slot);
+    if (target + 4 > size_) invalid();
+    *count = read<std::uint32_t>(data_ + target);
+    if (target + 4 + std::size_t(*count) * element_size > size_) invalid();
+    return target + 4;
+  }
+
+  // Table element of a vector of tables
+  Table Element(std::size_t vector, std::uint32_t i) const {
+    std::size_t field = vector + 4 * std::size_t(i);
+    if (field + 4 > size_) invalid();
+    return Table(data_, size_, field + read<std::uint32_t>(data_ + field));
+  }
+
+  std::string String(int slot) const {
+    std::uint32_t length;
+    std::size_t start = Vector(slot, &length, 1);
+    return std::string(reinterpret_cast<const char*>(data_ + start), length);
+  }
+
+  const std::uint8_t* data() const { return data_; }
+  std::size_t pos() const { return pos_; }
+
+private:
+  const std::uint8_t* data_;
+  std::size_t size_;
+  std::size_t pos_;
+  std::size_t vtable_;
+  std::uint16_t vtable_size_;
+};
+
+// -- Flatbuffers writer -------------------------------------------------------
+
+// Writes a flatbuffer front to back. Offsets always point forward, so
+// children are added after the table referring to them and patched in.
+class Builder {
+public:
+  struct Field {
+    int slot;
+    std::string bytes;  // little endian value, or 4 placeholder bytes
+  };
+
+  Builder() : buf_(4, '\0') {}
+
+  // Pad so that position + extra is a multiple of alignment
+  void Align(std::size_t alignment, std::size_t extra = 0) {
+    while ((buf_.size() + extra) % alignment != 0) {
+      buf_.push_back('\0');
+    }
+  }
+
+  template <typename T>
+  static Field Value(int slot, T value) {
+    std::string bytes(sizeof(T), '\0');
+    std::memcpy(&bytes[0], &value, sizeof(T));
+    return {slot, bytes};
+  }
+
+  static Field Offset(int slot) {
+    return {slot, std::string(4, '\0')};
+  }
+
+  // Write a table, returns its position and the position of each field in
+  // the order given
+  std::size_t AddTable(const std::vector<Field>& fields,
+                       std::vector<std::size_t>* positions) {
+    int slots = 0;
+    for (const Field& field : fields) {
+      slots = std::max(slots, field.slot + 1);
+    }
+    // Lay out fields by decreasing size so each one is naturally aligned
+    std::vector<std::size_t> order;
+    for (std::size_t size : {8, 4, 2, 1}) {
+      for (std::size_t i = 0; i < fields.size(); i++) {
+        if (fields[i].bytes.size() == size) order.push_back(i);
+      }
+    }
+    std::vector<std::uint16_t> offsets(fields.size());
+    std::uint16_t table_size = 8;
+    for (std::size_t i : order) {
+      offsets[i] = table_size;
+      table_size += std::uint16_t(fields[i].bytes.size());
+    }
+    std::vector<std::uint16_t> vtable(2 + slots, 0);
+    vtable[0] = std::uint16_t(2 * vtable.size());
+    vtable[1] = table_size;
+    for (std::size_t i = 0; i < fields.size(); i++) {
+      vtable[2 + fields[i].slot] = offsets[i];
+    }
+    Align(2);
+    std::size_t vtable_pos = buf_.size();
+    Append(vtable.data(), 2 * vtable.size());
+    // Table starts 8 bytes before its first field, aligned to 8
+    Align(8);
+    std::size_t table_pos = buf_.size();
+    std::int32_t soffset = std::int32_t(table_pos - vtable_pos);
+    Append(&soffset, 4);
+    Append("\0\0\0\0", 4);
+    buf_.resize(table_pos + table_size, '\0');
+    positions->assign(fields.size(), 0);
+    for (std::size_t i = 0; i < fields.size(); i++) {
+      std::memcpy(&buf_[table_pos + offsets[i]], fields[i].bytes.data(),
+                  fields[i].bytes.size());
+      (*positions)[i] = table_pos + offsets[i];
+    }
+    return table_pos;
+  }
+
+  // Write a vector of fixed size elements, returns its position
+  std::size_t AddVector(const void* data, std::uint32_t count,
+                        std::size_t element_size) {
+    Align(element_size >= 8 ? 8 : 4, 4);
+    std::size_t pos = buf_.size();
+    Append(&count, 4);
+    Append(data, count * element_size);
+    return pos;
+  }
+
+  // Write a null terminated string, returns its position
+  std::size_t AddString(const std::string& value) {
+    std::size_t pos = AddVector(value.data(), std::uint32_t(value.size()), 1);
+    buf_.push_back('\0');
+    return pos;
+  }
+
+  // Copy raw bytes aligned to 8, returns their position
+  std::size_t AddBlob(const void* data, std::size_t size) {
+    Align(8);
+    std::size_t pos = buf_.size();
+    Append(data, size);
+    return pos;
+  }
+
+  // Point the offset field at field_pos to target
+  void Patch(std::size_t field_pos, std::size_t target) {
+    std::uint32_t offset = std::uint32_t(target - field_pos);
+    std::memcpy(&buf_[field_pos], &offset, 4);
+  }
+
+  void SetRoot(std::size_t table) { Patch(0, table); }
+
+  const std::string& buffer() const { return buf_; }
+
+private:
+  void Append(const void* data, std::size_t size) {
+    buf_.append(static_cast<const char*>(data), size);
+  }
+
+  std::string buf_;
+};
+
+// -- Encapsulated messages ----------------------------------------------------
+
+// View over an encapsulated IPC message: continuation marker, metadata
+// length, Message flatbuffer padded to 8 bytes, then the body.
+struct Message {
+  const std::uint8_t* metadata;
+  std::size_t metadata_size;
+  const std::uint8_t* body;
+  std::size_t body_size;
+
+  Table Root() const { return Table::Root(metadata, metadata_size); }
+};
+
+inline Message parse_message(const std::string& page) {
+  const std::uint8_t* data = reinterpret_cast<const std::uint8_t*>(page.data());
+  std::size_t size = page.size();
+  std::size_t prefix = 4;
+  if (size < 8) invalid();
+  if (read<std::uint32_t>(data) == continuation) {
+    prefix = 8;
+  }
+  std::int32_t metadata_size = read<std::int32_t>(data + prefix - 4);
+  if (metadata_size < 0 || prefix + std::size_t(metadata_size) > size) invalid();
+  Message message;
+  message.metadata = data + prefix;
+  message.metadata_size = std::size_t(metadata_size);
+  message.body = message.metadata + metadata_size;
+  message.body_size = size - prefix - metadata_size;
+  return message;
+}
+
+// Frame a Message flatbuffer as an encapsulated message followed by a body
+// of body_size bytes. Returns the offset where the body starts.
+inline std::size_t frame_message(const std::string& metadata,
+                                 std::size_t body_size, std::string* out) {
+  std::size_t metadata_size = pad8(metadata.size());
+  out->assign(8 + metadata_size + body_size, '\0');
+  std::int32_t length = std::int32_t(metadata_size);
+  std::memcpy(&(*out)[0], &continuation, 4);
+  std::memcpy(&(*out)[4], &length, 4);
+  std::memcpy(&(*out)[8], metadata.data(), metadata.size());
+  return 8 + metadata_size;
+}
+
+// Compression codec of a record batch message, codec::none when the
+// buffers are not compressed
+inline codec::Codec record_batch_codec(const Message& message) {
+  Table root = message.Root();
+  if (root.Scalar<std::uint8_t>(message_header_type, 0) != header_record_batch) {
+    return codec::none;
+  }
+  Table batch = root.Child(message_header);
+  if (!batch.Has(record_batch_compression)) {
+    return codec::none;
+  }
+  Table compression = batch.Child(record_batch_compression);
+  return compression.Scalar<std::int8_t>(body_compression_codec, 0) == 0 ?
+    codec::lz4_frame : codec::zstd;
+}
+
+// Rewrite a record batch with compressed buffers as an uncompressed one.
+// Each buffer starts with its uncompressed length, -1 when it was stored
+// as is. Messages without compression are returned untouched.
+inline void decompress_record_batch(std::string* page) {
+  Message message = parse_message(*page);
+  codec::Codec buffer_codec = record_batch_codec(message);
+  if (buffer_codec == codec::none) {
+    return;
+  }
+  Table root = message.Root();
+  Table batch = root.Child(message_header);
+
+  std::uint32_t n_nodes, n_buffers, n_variadic = 0;
+  std::size_t nodes = batch.Vector(record_batch_nodes, &n_nodes, 16);
+  std::size_t buffers = batch.Vector(record_batch_buffers, &n_buffers, 16);
+  std::size_t variadic = 0;
+  if (batch.Has(record_batch_variadic_counts)) {
+    variadic = batch.Vector(record_batch_variadic_counts, &n_variadic, 8);
+  }
+
+  // Uncompressed layout, each buffer aligned to 8 bytes
+  std::vector<std::int64_t> layout(2 * n_buffers);
+  std::size_t body_size = 0;
+  for (std::uint32_t i = 0; i < n_buffers; i++) {
+    std::int64_t offset = read<std::int64_t>(message.metadata + buffers + 16 * i);
+    std::int64_t length = read<std::int64_t>(message.metadata + buffers + 16 * i + 8);
+    if (offset < 0 || length < 0 ||
+        std::size_t(offset + length) > message.body_size) invalid();
+    std::int64_t size = 0;
+    if (length > 0) {
+      if (length < 8) invalid();
+      size = read<std::int64_t>(message.body + offset);
+      if (size == -1) {
+        size = length - 8;
+      } else if (size < 0) {
+        invalid();
+      }
+    }
+    layout[2 * i] = std::int64_t(body_size);
+    layout[2 * i + 1] = size;
+    body_size += pad8(std::size_t(size));
+  }
+
+  // Message and RecordBatch tables, without compression
+  Builder builder;
+  std::vector<std::size_t> fields;
+  std::size_t message_table = builder.AddTable({
+    Builder::Value<std::int16_t>(message_version,
+      root.Scalar<std::int16_t>(message_version, 0)),
+    Builder::Value<std::uint8_t>(message_header_type, header_record_batch),
+    Builder::Offset(message_header),
+    Builder::Value<std::int64_t>(message_body_length, std::int64_t(body_size))
+  }, &fields);
+  builder.SetRoot(message_table);
+  std::size_t header_field = fields[2];
+  std::vector<Builder::Field> batch_fields = {
+    Builder::Value<std::int64_t>(record_batch_length,
+      batch.Scalar<std::int64_t>(record_batch_length, 0)),
+    Builder::Offset(record_batch_nodes),
+    Builder::Offset(record_batch_buffers)
+  };
+  if (variadic) {
+    batch_fields.push_back(Builder::Offset(record_batch_variadic_counts));
+  }
+  std::size_t batch_table = builder.AddTable(batch_fields, &fields);
+  builder.Patch(header_field, batch_table);
+  builder.Patch(fields[1],
+    builder.AddVector(message.metadata + nodes, n_nodes, 16));
+  builder.Patch(fields[2],
+    builder.AddVector(layout.data(), n_buffers, 16));
+  if (variadic) {
+    builder.Patch(fields[3],
+      builder.AddVector(message.metadata + variadic, n_variadic, 8));
+  }
+
+  std::string out;
+  std::size_t body_start = frame_message(builder.buffer(), body_size, &out);
+  std::uint8_t* body = reinterpret_cast<std::uint8_t*>(&out[body_start]);
+  for (std::uint32_t i = 0; i < n_buffers; i++) {
+    std::int64_t offset = read<std::int64_t>(message.metadata + buffers + 16 * i);
+    std::int64_t length = read<std::int64_t>(message.metadata + buffers + 16 * i + 8);
+    if (length == 0) continue;
+    const std::uint8_t* src = message.body + offset + 8;
+    std::uint8_t* dst = body + layout[2 * i];
+    if (read<std::int64_t>(message.body + offset) == -1) {
+      std::memcpy(dst, src, std::size_t(length - 8));
+    } else {
+      codec::decompress(buffer_codec, src, std::size_t(length - 8),
+                        dst, std::size_t(layout[2 * i + 1]));
+    }
+  }
+  page->swap(out);
+}
+
+// -- Schema -------------------------------------------------------------------
+
+// Description of a schema field and its type parameters
+struct Field {
+  std::string name;
+  bool nullable = true;
+  std::uint8_t type = type_none;
+  int bit_width = 0;
+  bool is_signed = false;
+  int precision = 0;
+  int scale = 0;
+  // Date, time, timestamp, duration or interval unit
+  int unit = 0;
+  // Byte width of fixed size binaries, list size of fixed size lists
+  int size = 0;
+  bool keys_sorted = false;
+  std::string timezone;
+  std::string extension;
+  std::vector<std::pair<std::string, std::string> > metadata;
+  std::vector<Field> children;
+};
+
+inline Field parse_field(const Table& table) {
+  Field field;
+  if (table.Has(field_name)) {
+    field.name = table.String(field_name);
+  }
+  field.nullable = table.Scalar<std::uint8_t>(field_nullable, 0) != 0;
+  field.type = table.Scalar<std::uint8_t>(field_type_type, type_none);
+  switch (field.type) {
+  case type_date:
+    field.unit = date_unit_default;
+    break;
+  case type_time:
+    field.unit = time_unit_default;
+    break;
+  case type_duration:
+    field.unit = duration_unit_default;
+    break;
+  case type_decimal:
+    field.bit_width = 128;
+    break;
+  }
+  if (table.Has(field_type)) {
+    Table type = table.Child(field_type);
+    switch (field.type) {
+    case type_int:
+      field.bit_width = type.Scalar<std::int32_t>(int_bit_width, 0);
+      field.is_signed = type.Scalar<std::uint8_t>(int_is_signed, 0) != 0;
+      break;
+    case type_floating_point:
+      field.bit_width = 16 << type.Scalar<std::int16_t>(
+        floating_point_precision, 0);
+      break;
+    case type_decimal:
+      field.precision = type.Scalar<std::int32_t>(decimal_precision, 0);
+      field.scale = type.Scalar<std::int32_t>(decimal_scale, 0);
+      field.bit_width = type.Scalar<std::int32_t>(decimal_bit_width, 128);
+      break;
+    case type_date:
+      field.unit = type.Scalar<std::int16_t>(date_unit, date_unit_default);
+      break;
+    case type_time:
+      field.unit = type.Scalar<std::int16_t>(time_unit, time_unit_default);
+      break;
+    case type_duration:
+      field.unit = type.Scalar<std::int16_t>(duration_unit,
+                                             duration_unit_default);
+      break;
+    case type_timestamp:
+      field.unit = type.Scalar<std::int16_t>(timestamp_unit, 0);
+      if (type.Has(timestamp_timezone)) {
+        field.timezone = type.String(timestamp_timezone);
+      }
+      break;
+    case type_interval:
+      field.unit = type.Scalar<std::int16_t>(interval_unit, 0);
+      break;
+    case type_fixed_size_binary:
+      field.size = type.Scalar<std::int32_t>(fixed_size_binary_byte_width, 0);
+      break;
+    case type_fixed_size_list:
+      field.size = type.Scalar<std::int32_t>(fixed_size_list_list_size, 0);
+      break;
+    case type_map:
+      field.keys_sorted = type.Scalar<std::uint8_t>(map_keys_sorted, 0) != 0;
+      break;
+    }
+  }
+  if (table.Has(field_custom_metadata)) {
+    std::uint32_t count;
+    std::size_t vector = table.Vector(field_custom_metadata, &count, 4);
+    for (std::uint32_t i = 0; i < count; i++) {
+      Table pair = table.Element(vector, i);
+      if (!pair.Has(key_value_key)) {
+        continue;
+      }
+      std::string key = pair.String(key_value_key);
+      std::string value = pair.Has(key_value_value) ?
+        pair.String(key_value_value) : std::string();
+      if (key == "ARROW:extension:name") {
+        field.extension = value;
+      }
+      field.metadata.emplace_back(key, value);
+    }
+  }
+  if (table.Has(field_children)) {
+    std::uint32_t count;
+    std::size_t vector = table.Vector(field_children, &count, 4);
+    for (std::uint32_t i = 0; i < count; i++) {
+      field.children.push_back(parse_field(table.Element(vector, i)));
+    }
+  }
+  return field;
+}
+
+// Fields of an encapsulated schema message
+inline std::vector<Field> parse_schema(const std::string& page) {
+  Message message = parse_message(page);
+  Table root = message.Root();
+  if (root.Scalar<std::uint8_t>(message_header_type, 0) != header_schema) {
+    invalid();
+  }
+  Table schema = root.Child(message_header);
+  std::vector<Field> fields;
+  if (schema.Has(schema_fields)) {
+    std::uint32_t count;
+    std::size_t vector = schema.Vector(schema_fields, &count, 4);
+    for (std::uint32_t i = 0; i < count; i++) {
+      fields.push_back(parse_field(schema.Element(vector, i)));
+    }
+  }
+  return fields;
+}
+
+// -- Slicing ------------------------------------------------------------------
+
+// Number of rows of a record batch message
+inline std::int64_t record_batch_rows(const std::string& page) {
+  Table root = parse_message(page).Root();
+  if (root.Scalar<std::uint8_t>(message_header_type, 0) != header_record_batch) {
+    invalid();
+  }
+  return root.Child(message_header).Scalar<std::int64_t>(record_batch_length, 0);
+}
+
+// Field nodes and buffers of a field and its children in a record batch,
+// -1 for layouts that can not be sliced
+inline int field_nodes(const Field& field) {
+  int nodes = 1;
+  for (const Field& child : field.children) {
+    nodes += field_nodes(child);
+  }
+  return nodes;
+}
+
+// Buffers of a field itself, -1 for unsupported layouts
+inline int type_buffers(std::uint8_t type) {
+  switch (type) {
+  case type_null:
+    return 0;
+  case type_struct:
+  case type_fixed_size_list:
+    return 1;
+  case type_int: case type_floating_point: case type_bool: case type_decimal:
+  case type_date: case type_time: case type_timestamp: case type_interval:
+  case type_duration: case type_fixed_size_binary:
+  case type_list: case type_large_list: case type_map:
+    return 2;
+  case type_binary: case type_utf8:
+  case type_large_binary: case type_large_utf8:
+    return 3;
+  default:
+    return -1;
+  }
+}
+
+inline int field_buffers(const Field& field) {
+  int buffers = type_buffers(field.type);
+  if (buffers < 0) {
+    return -1;
+  }
+  for (const Field& child : field.children) {
+    int more = field_buffers(child);
+    if (more < 0) {
+      return -1;
+    }
+    buffers += more;
+  }
+  return buffers;
+}
+
+// Keep the first length rows of an uncompressed record batch by rewriting
+// its metadata in place: the batch length and the length and null count of
+// the top level field nodes. Buffers are left untouched, children may be
+// longer than their parent. Returns false when the batch can not be sliced.
+inline bool slice_record_batch(std::string* page,
+                               const std::vector<Field>& fields,
+                               std::int64_t length) {
+  Message message = parse_message(*page);
+  Table root = message.Root();
+  if (root.Scalar<std::uint8_t>(message_header_type, 0) != header_record_batch ||
+      record_batch_codec(message) != codec::none) {
+    return false;
+  }
+  Table batch = root.Child(message_header);
+  if (!batch.Has(record_batch_length) ||
+      length >= batch.Scalar<std::int64_t>(record_batch_length, 0)) {
+    return false;
+  }
+  std::uint32_t n_nodes, n_buffers;
+  std::size_t nodes = batch.Vector(record_batch_nodes, &n_nodes, 16);
+  std::size_t buffers = batch.Vector(record_batch_buffers, &n_buffers, 16);
+
+  // Locate and check everything before writing anything
+  std::vector<std::pair<std::size_t, std::int64_t> > writes;
+  std::size_t node = 0, buffer = 0;
+  for (const Field& field : fields) {
+    int more_nodes = field_nodes(field);
+    int more_buffers = field_buffers(field);
+    if (more_buffers < 0 || node + more_nodes > n_nodes ||
+        buffer + more_buffers > n_buffers) {
+      return false;
+    }
+    std::size_t pos = nodes + 16 * node;
+    std::int64_t null_count = read<std::int64_t>(message.metadata + pos + 8);
+    if (field.type == type_null) {
+      null_count = length;
+    } else if (null_count > 0) {
+      std::int64_t offset = read<std::int64_t>(
+        message.metadata + buffers + 16 * buffer);
+      std::int64_t size = read<std::int64_t>(
+        message.metadata + buffers + 16 * buffer + 8);
+      if (offset < 0 || size < (length + 7) / 8 ||
+          std::size_t(offset + size) > message.body_size) {
+        return false;
+      }
+      const std::uint8_t* validity = message.body + offset;
+      null_count = 0;
+      for (std::int64_t i = 0; i < length; i++) {
+        null_count += !((validity[i >> 3] >> (i & 7)) & 1);
+      }
+    }
+    writes.emplace_back(pos, length);
+    writes.emplace_back(pos + 8, null_count);
+    node += more_nodes;
+    buffer += more_buffers;
+  }
+  if (node != n_nodes || buffer != n_buffers) {
+    return false;
+  }
+  writes.emplace_back(batch.Field(record_batch_length), length);
+
+  std::size_t metadata = message.metadata -
+    reinterpret_cast<const std::uint8_t*>(page->data());
+  for (const std::pair<std::size_t, std::int64_t>& write : writes) {
+    std::memcpy(&(*page)[metadata + write.first], &write.second, 8);
+  }
+  return true;
+}
+
+// -- C data interface ---------------------------------------------------------
+
+// Format string of a field type, throws for types the C data interface
+// export does not cover
+inline std::string field_format(const Field& field) {
+  static const char time_units[] = "smun";
+  switch (field.type) {
+  case type_null:
+    return "n";
+  case type_bool:
+    return "b";
+  case type_int: {
+    const char* formats = field.is_signed ? "csil" : "CSIL";
+    switch (field.bit_width) {
+    case 8: return std::string(1, formats[0]);
+    case 16: return std::string(1, formats[1]);
+    case 32: return std::string(1, formats[2]);
+    case 64: return std::string(1, formats[3]);
+    }
+    break;
+  }
+  case type_floating_point:
+    switch (field.bit_width) {
+    case 16: return "e";
+    case 32: return "f";
+    case 64: return "g";
+    }
+    break;
+  case type_binary:
+    return "z";
+  case type_large_binary:
+    return "Z";
+  case type_utf8:
+    return "u";
+  case type_large_utf8:
+    return "U";
+  case type_fixed_size_binary:
+    return "w:" + std::to_string(field.size);
+  case type_decimal:
+    return "d:" + std::to_string(field.precision) + "," +
+      std::to_string(field.scale) +
+      (field.bit_width == 128 ? "" : "," + std::to_string(field.bit_width));
+  case type_date:
+    if (field.unit == 0 || field.unit == 1) {
+      return field.unit == 0 ? "tdD" : "tdm";
+    }
+    break;
+  case type_time:
+    if (field.unit >= 0 && field.unit < 4) {
+      return std::string("tt") + time_units[field.unit];
+    }
+    break;
+  case type_timestamp:
+    if (field.unit >= 0 && field.unit < 4) {
+      return std::string("ts") + time_units[field.unit] + ":" + field.timezone;
+    }
+    break;
+  case type_duration:
+    if (field.unit >= 0 && field.unit < 4) {
+      return std::string("tD") + time_units[field.unit];
+    }
+    break;
+  case type_interval:
+    if (field.unit >= 0 && field.unit < 3) {
+      return std::string("ti") + "MDn"[field.unit];
+    }
+    break;
+  case type_list:
+    return "+l";
+  case type_large_list:
+    return "+L";
+  case type_fixed_size_list:
+    return "+w:" + std::to_string(field.size);
+  case type_struct:
+    return "+s";
+  case type_map:
+    return "+m";
+  }
+  throw std::runtime_error("Unsupported Arrow type in field `" +
+                           field.name + "`.");
+}
+
+// Custom metadata in the C data interface layout: pair count, then length
+// prefixed keys and values
+inline std::string field_metadata(const Field& field) {
+  std::string out;
+  if (field.metadata.empty()) {
+    return out;
+  }
+  auto append = [&out](std::int32_t value) {
+    out.append(reinterpret_cast<const char*>(&value), 4);
+  };
+  append(std::int32_t(field.metadata.size()));
+  for (const std::pair<std::string, std::string>& pair : field.metadata) {
+    append(std::int32_t(pair.first.size()));
+    out += pair.first;
+    append(std::int32_t(pair.second.size()));
+    out += pair.second;
+  }
+  return out;
+}
+
+// Owned by an exported schema node and freed on release
+struct SchemaData {
+  std::string format;
+  std::string name;
+  std::string metadata;
+  std::vector<ArrowSchema> children;
+  std::vector<ArrowSchema*> pointers;
+};
+
+inline void release_schema(ArrowSchema* schema) {
+  SchemaData* data = static_cast<SchemaData*>(schema->private_data);
+  for (ArrowSchema& child : data->children) {
+    if (child.release != nullptr) {
+      child.release(&child);
+    }
+  }
+  delete data;
+  schema->release = nullptr;
+}
+
+// Fill out with a node named name, owning its formats and children from
+// the start so a partial export is released whole on error
+inline void export_node(const std::string& format, const std::string& name,
+                        const std::string& metadata, std::int64_t flags,
+                        const std::vector<Field>& children, ArrowSchema* out) {
+  SchemaData* data = new SchemaData();
+  data->format = format;
+  data->name = name;
+  data->metadata = metadata;
+  data->children.resize(children.size());
+  for (std::size_t i = 0; i < children.size(); i++) {
+    data->children[i].release = nullptr;
+    data->pointers.push_back(&data->children[i]);
+  }
+  out->format = data->format.c_str();
+  out->name = data->name.c_str();
+  out->metadata = data->metadata.empty() ? nullptr : data->metadata.data();
+  out->flags = flags;
+  out->n_children = std::int64_t(children.size());
+  out->children = data->pointers.empty() ? nullptr : data->pointers.data();
+  out->dictionary = nullptr;
+  out->release = release_schema;
+  out->private_data = data;
+  for (std::size_t i = 0; i < children.size(); i++) {
+    const Field& child = children[i];
+    std::int64_t child_flags = child.nullable ? ARROW_FLAG_NULLABLE : 0;
+    if (child.type == type_map && child.keys_sorted) {
+      child_flags |= ARROW_FLAG_MAP_KEYS_SORTED;
+    }
+    export_node(field_format(child), child.name, field_metadata(child),
+                child_flags, child.children, &data->children[i]);
+  }
+}
+
+// Export the fields of a schema as a struct, the type of record batches
+inline void export_schema(const std::vector<Field>& fields, ArrowSchema* out) {
+  out->release = nullptr;
+  try {
+    export_node("+s", "", "", 0, fields, out);
+  } catch (...) {
+    if (out->release != nullptr) {
+      out->release(out);
+    }
+    throw;
+  }
+}
+
+// Owned by an exported array node and freed on release. Buffers point into
+// the record batch message, shared by all nodes of the batch.
+struct ArrayData {
+  std::shared_ptr<const std::string> page;
+  std::vector<const void*> buffers;
+  std::vector<ArrowArray> children;
+  std::vector<ArrowArray*> pointers;
+};
+
+inline void release_array(ArrowArray* array) {
+  ArrayData* data = static_cast<ArrayData*>(array->private_data);
+  for (ArrowArray& child : data->children) {
+    if (child.release != nullptr) {
+      child.release(&child);
+    }
+  }
+  delete data;
+  array->release = nullptr;
+}
+
+inline ArrayData* new_array(const std::shared_ptr<const std::string>& page,
+                            std::size_t n_buffers, std::size_t n_children,
+                            ArrowArray* out) {
+  ArrayData* data = new ArrayData();
+  data->page = page;
+  data->buffers.assign(n_buffers, nullptr);
+  data->children.resize(n_children);
+  for (std::size_t i = 0; i < n_children; i++) {
+    data->children[i].release = nullptr;
+    data->pointers.push_back(&data->children[i]);
+  }
+  out->length = 0;
+  out->null_count = 0;
+  out->offset = 0;
+  out->n_buffers = std::int64_t(n_buffers);
+  out->n_children = std::int64_t(n_children);
+  out->buffers = data->buffers.empty() ? nullptr : data->buffers.data();
+  out->children = data->pointers.empty() ? nullptr : data->pointers.data();
+  out->dictionary = nullptr;
+  out->release = release_array;
+  out->private_data = data;
+  return data;
+}
+
+inline bool has_offsets(std::uint8_t type) {
+  switch (type) {
+  case type_binary: case type_utf8: case type_large_binary:
+  case type_large_utf8: case type_list: case type_large_list: case type_map:
+    return true;
+  default:
+    return false;
+  }
+}
+
+inline const void* zero_offsets() {
+  static const std::int64_t zeros[1] = {0};
+  return zeros;
+}
+
+// Walks the field nodes and buffers of a record batch in schema order
+class BatchExport {
+public:
+  BatchExport(const std::shared_ptr<const std::string>& page,
+              const Message& message, const Table& batch)
+    : page_(page), message_(message) {
+    nodes_ = batch.Vector(record_batch_nodes, &n_nodes_, 16);
+    buffers_ = batch.Vector(record_batch_buffers, &n_buffers_, 16);
+  }
+
+  void Export(const Field& field, ArrowArray* out) {
+    int n_buffers = type_buffers(field.type);
+    if (n_buffers < 0 || node_ >= n_nodes_ ||
+        buffer_ + std::uint32_t(n_buffers) > n_buffers_) {
+      invalid();
+    }
+    ArrayData* data = new_array(page_, std::size_t(n_buffers),
+                                field.children.size(), out);
+    const std::uint8_t* node = message_.metadata + nodes_ + 16 * node_++;
+    out->length = read<std::int64_t>(node);
+    out->null_count = read<std::int64_t>(node + 8);
+    if (out->length < 0 || out->null_count < 0) {
+      invalid();
+    }
+    for (int i = 0; i < n_buffers; i++) {
+      std::int64_t size;
+      const void* buffer = Buffer(&size);
+      if (i == 0) {
+        // No validity bitmap is needed without nulls
+        if (out->null_count > 0 && size == 0) {
+          invalid();
+        }
+        buffer = out->null_count > 0 ? buffer : nullptr;
+      } else if (i == 1 && size == 0 && has_offsets(field.type)) {
+        // Empty arrays may come without their single offset
+        buffer = zero_offsets();
+      }
+      data->buffers[std::size_t(i)] = buffer;
+    }
+    for (std::size_t i = 0; i < field.children.size(); i++) {
+      Export(field.children[i], &data->children[i]);
+    }
+  }
+
+  bool Done() const {
+    return node_ == n_nodes_ && buffer_ == n_buffers_;
+  }
+
+private:
+  const void* Buffer(std::int64_t* size) {
+    const std::uint8_t* buffer = message_.metadata + buffers_ + 16 * buffer_++;
+    std::int64_t offset = read<std::int64_t>(buffer);
+    *size = read<std::int64_t>(buffer + 8);
+    if (offset < 0 || *size < 0 ||
+        std::uint64_t(offset) + std::uint64_t(*size) > message_.body_size) {
+      invalid();
+    }
+    return message_.body + offset;
+  }
+
+  std::shared_ptr<const std::string> page_;
+  Message message_;
+  std::size_t nodes_;
+  std::size_t buffers_;
+  std::uint32_t n_nodes_;
+  std::uint32_t n_buffers_;
+  std::uint32_t node_ = 0;
+  std::uint32_t buffer_ = 0;
+};
+
+// Export an uncompressed record batch message of a schema with the given
+// fields as a struct array. Buffers are not copied: every node keeps the
+// page alive until released.
+inline void export_record_batch(const std::shared_ptr<const std::string>& page,
+                                const std::vector<Field>& fields,
+                                ArrowArray* out) {
+  out->release = nullptr;
+  Message message = parse_message(*page);
+  Table root = message.Root();
+  if (root.Scalar<std::uint8_t>(message_header_type, 0) != header_record_batch ||
+      record_batch_codec(message) != codec::none) {
+    invalid();
+  }
+  Table batch = root.Child(message_header);
+  try {
+    BatchExport walk(page, message, batch);
+    ArrayData* data = new_array(page, 1, fields.size(), out);
+    out->length = batch.Scalar<std::int64_t>(record_batch_length, 0);
+    for (std::size_t i = 0; i < fields.size(); i++) {
+      walk.Export(fields[i], &data->children[i]);
+    }
+    if (!walk.Done()) {
+      invalid();
+    }
+  } catch (...) {
+    if (out->release != nullptr) {
+      out->release(out);
+    }
+    throw;
+  }
+}
+
+// -- IPC file format ----------------------------------------------------------
+
+// File.fbs Block struct, locating one message in the file
+struct Block {
+  std::int64_t offset;
+  std::int32_t metadata_length;
+  std::int32_t padding;
+  std::int64_t body_length;
+};
+
+// Footer flatbuffer of an IPC file. The Schema table is not rebuilt: the
+// schema Message flatbuffer is copied whole, offsets being relative, and
+// the footer points at the Schema table inside it.
+inline std::string file_footer(const std::string& schema,
+                               const std::vector<Block>& blocks) {
+  Message message = parse_message(schema);
+  Table root = message.Root();
+  if (root.Scalar<std::uint8_t>(message_header_type, 0) != header_schema) {
+    invalid();
+  }
+  Builder builder;
+  std::vector<std::size_t> fields;
+  std::size_t footer = builder.AddTable({
+    Builder::Value<std::int16_t>(footer_version,
+      root.Scalar<std::int16_t>(message_version, 0)),
+    Builder::Offset(footer_schema),
+    Builder::Offset(footer_dictionaries),
+    Builder::Offset(footer_record_batches)
+  }, &fields);
+  builder.SetRoot(footer);
+  std::size_t copy = builder.AddBlob(message.metadata, message.metadata_size);
+  builder.Patch(fields[1], copy + root.Target(message_header));
+  Block none;
+  builder.Patch(fields[2], builder.AddVector(&none, 0, sizeof(Block)));
+  builder.Patch(fields[3],
+    builder.AddVector(blocks.data(), std::uint32_t(blocks.size()),
+                      sizeof(Block)));
+  return builder.buffer();
+}
+
+// Writes encapsulated messages to an IPC file as they come: magic, schema,
+// record batches, then on Close the end of stream marker and the footer.
+class FileWriter {
+public:
+  FileWriter(const std::string& path, const std::string& schema,
+             std::size_t buffer_size)
+    : path_(path), schema_(schema), buffer_(buffer_size) {
+    out_.rdbuf()->pubsetbuf(buffer_.data(), buffer_.size());
+    out_.open(path, std::ios::binary | std::ios::trunc);
+    Write("ARROW1\0\0", 8);
+    Write(schema.data(), schema.size());
+    Align();
+  }
+
+  void WriteBatch(const std::string& page) {
+    Message message = parse_message(page);
+    Block block;
+    block.offset = position_;
+    block.metadata_length = std::int32_t(
+      message.body - reinterpret_cast<const std::uint8_t*>(page.data()));
+    block.padding = 0;
+    block.body_length = std::int64_t(message.body_size);
+    blocks_.push_back(block);
+    Write(page.data(), page.size());
+    Align();
+  }
+
+  void Close() {
+    std::uint32_t eos[2] = {continuation, 0};
+    Write(eos, 8);
+    std::string footer = file_footer(schema_, blocks_);
+    std::int32_t footer_size = std::int32_t(footer.size());
+    Write(footer.data(), footer.size());
+    Write(&footer_size, 4);
+    Write("ARROW1", 6);
+    out_.close();
+    if (out_.fail()) {
+      Fail();
+    }
+  }
+
+  std::size_t batches() const { return blocks_.size(); }
+
+private:
+  void Write(const void* data, std::size_t size) {
+    out_.write(static_cast<const char*>(data), size);
+    if (!out_) {
+      Fail();
+    }
+    position_ += size;
+  }
+
+  // Messages start on 8 byte boundaries
+  void Align() {
+    static const char zeros[8] = {0};
+    Write(zeros, pad8(position_) - position_);
+  }
+
+  void Fail() {
+    throw std::runtime_error("Could not write Arrow IPC file `" + path_ + "`.");
+  }
+
+  std::string path_;
+  std::string schema_;
+  std::vector<char> buffer_;
+  std::ofstream out_;
+  std::int64_t position_ = 0;
+  std::vector<Block> blocks_;
+};
+
+} // namespace arrow_ipc
+
+#endif
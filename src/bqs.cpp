@@ -1,5 +1,20 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
 #include <vector>
 #include <grpc/grpc.h>
 
@@ -24,15 +39,31 @@
 #endif
 
 #include <grpcpp/grpcpp.h>
+#include <grpcpp/alarm.h>
+#include <grpcpp/generic/generic_stub.h>
+#include <grpcpp/resource_quota.h>
 #include "google/cloud/bigquery/storage/v1/stream.pb.h"
 #include "google/cloud/bigquery/storage/v1/storage.pb.h"
 # pragma GCC diagnostic ignored "-Winconsistent-missing-override"
 #include "google/cloud/bigquery/storage/v1/storage.grpc.pb.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include <Rcpp.h>
+#include <R_ext/Altrep.h>
 #include "RProgress.h"
+#include "arrow_ipc.h"
 
 using google::cloud::bigquery::storage::v1::ReadSession;
+using google::cloud::bigquery::storage::v1::ArrowSerializationOptions;
 using google::cloud::bigquery::storage::v1::BigQueryRead;
+using google::cloud::bigquery::storage::v1::ReadRowsResponse;
 
 // -- Utilities and logging ----------------------------------------------------
 // Define a default logger for gRPC
@@ -102,6 +133,18 @@ std::string grpc_version() {
   return version;
 }
 
+// Compression codecs this build can decode
+// [[Rcpp::export(rng=false)]]
+std::vector<std::string> bqs_codecs() {
+  std::vector<std::string> out;
+  for (codec::Codec codec : {codec::lz4_frame, codec::zstd}) {
+    if (codec::available(codec)) {
+      out.push_back(codec::name(codec));
+    }
+  }
+  return out;
+}
+
 // Simple read file to read configuration from json
 std::string readfile(std::string filename)
 {
@@ -111,334 +154,3416 @@ std::string readfile(std::string filename)
   return content;
 }
 
-// append std::string at the end of a std::vector<uint8_t> vector
-void to_raw(const std::string input, std::vector<uint8_t>* output) {
-  output->insert(output->end(), input.begin(), input.end());
+// BigQuery type of a read session schema field, named as in the tables REST
+// API. Empty when the Arrow type has no BigQuery counterpart.
+std::string bq_type(const arrow_ipc::Field& field) {
+  if (field.extension == "google:sqlType:datetime") {
+    return "DATETIME";
+  }
+  if (field.extension == "google:sqlType:geography") {
+    return "GEOGRAPHY";
+  }
+  if (field.extension == "google:sqlType:json") {
+    return "JSON";
+  }
+  switch (field.type) {
+  case arrow_ipc::type_int:
+    return "INTEGER";
+  case arrow_ipc::type_floating_point:
+    return "FLOAT";
+  case arrow_ipc::type_bool:
+    return "BOOLEAN";
+  case arrow_ipc::type_utf8:
+  case arrow_ipc::type_large_utf8:
+    return "STRING";
+  case arrow_ipc::type_binary:
+  case arrow_ipc::type_large_binary:
+    return "BYTES";
+  case arrow_ipc::type_decimal:
+    return field.bit_width > 128 ? "BIGNUMERIC" : "NUMERIC";
+  case arrow_ipc::type_date:
+    return "DATE";
+  case arrow_ipc::type_time:
+    return "TIME";
+  case arrow_ipc::type_timestamp:
+    return field.timezone.empty() ? "DATETIME" : "TIMESTAMP";
+  case arrow_ipc::type_interval:
+    return "INTERVAL";
+  case arrow_ipc::type_struct:
+    return "RECORD";
+  }
+  return "";
+}
+
+// Describe schema fields like bigrquery::bq_table_fields, with name, type,
+// mode and subfields. Repeated fields are served as lists of their items.
+Rcpp::List bq_fields(const std::vector<arrow_ipc::Field>& fields) {
+  Rcpp::List out(fields.size());
+  for (std::size_t i = 0; i < fields.size(); i++) {
+    const arrow_ipc::Field* field = &fields[i];
+    std::string mode = field->nullable ? "NULLABLE" : "REQUIRED";
+    if ((field->type == arrow_ipc::type_list ||
+         field->type == arrow_ipc::type_large_list) &&
+        field->children.size() == 1) {
+      mode = "REPEATED";
+      field = &field->children[0];
+    }
+    out[i] = Rcpp::List::create(
+      Rcpp::Named("name") = fields[i].name,
+      Rcpp::Named("type") = bq_type(*field),
+      Rcpp::Named("mode") = mode,
+      Rcpp::Named("fields") = bq_fields(field->children));
+  }
+  return out;
 }
 
-// -- Client class -------------------------------------------------------------
+// -- Read rows responses -----------------------------------------------------
 
-class BigQueryReadClient {
+// Record batch bytes of a response. Uncompressed batches stay in the
+// reference counted slices gRPC received them in until they are copied to
+// their destination, decompressed ones are held as a string.
+class Payload {
 public:
-  BigQueryReadClient(std::shared_ptr<grpc::Channel> channel)
-    : stub_(BigQueryRead::NewStub(channel)) {
+  std::size_t size() const {
+    return slices_.empty() ? data_.size() : size_;
   }
-  void SetClientInfo(const std::string &client_info) {
-    client_info_ = client_info;
+
+  void Assign(std::vector<grpc::Slice>* slices) {
+    slices_.swap(*slices);
+    std::string().swap(data_);
+    size_ = 0;
+    for (const grpc::Slice& slice : slices_) {
+      size_ += slice.size();
+    }
   }
 
-  // Creation read sessions
-  ReadSession CreateReadSession(const std::string& project,
-                                const std::string& dataset,
-                                const std::string& table,
-                                const std::string& parent,
-                                const std::int64_t& timestamp_seconds,
-                                const std::int32_t& timestamp_nanos,
-                                const std::vector<std::string>& selected_fields,
-                                const std::string& row_restriction,
-                                const std::double_t& sample_percentage
-  ) {
-    google::cloud::bigquery::storage::v1::CreateReadSessionRequest method_request;
-    ReadSession *read_session = method_request.mutable_read_session();
-    std::string table_fullname =
-      "projects/" + project + "/datasets/" + dataset + "/tables/" + table;
-    read_session->set_table(table_fullname);
-    read_session->set_data_format(
-        google::cloud::bigquery::storage::v1::DataFormat::ARROW);
-    if (timestamp_seconds > 0 || timestamp_nanos > 0) {
-      read_session->mutable_table_modifiers()->
-        mutable_snapshot_time()->set_seconds(timestamp_seconds);
-      read_session->mutable_table_modifiers()->
-        mutable_snapshot_time()->set_nanos(timestamp_nanos);
+  void Assign(std::string* data) {
+    std::vector<grpc::Slice>().swap(slices_);
+    data_.swap(*data);
+    size_ = 0;
+  }
+
+  // Copy len bytes from offset to out
+  void CopyTo(std::size_t offset, void* out, std::size_t len) const {
+    std::uint8_t* pos = static_cast<std::uint8_t*>(out);
+    if (slices_.empty()) {
+      std::memcpy(pos, data_.data() + offset, len);
+      return;
     }
-    for (int i = 0; i < int(selected_fields.size()); i++) {
-      read_session->mutable_read_options()->
-        add_selected_fields(selected_fields[i]);
+    for (const grpc::Slice& slice : slices_) {
+      if (len == 0) {
+        break;
+      }
+      if (offset >= slice.size()) {
+        offset -= slice.size();
+        continue;
+      }
+      std::size_t part = std::min(len, slice.size() - offset);
+      std::memcpy(pos, slice.begin() + offset, part);
+      pos += part;
+      len -= part;
+      offset = 0;
     }
-    if (!row_restriction.empty()) {
-      read_session->mutable_read_options()->
-        set_row_restriction(row_restriction);
+  }
+
+  // The batch as one string, which may be changed in place. Slices are
+  // copied out once and released.
+  std::string* Flatten() {
+    if (!slices_.empty()) {
+      std::string data(size_, '\0');
+      CopyTo(0, &data[0], size_);
+      Assign(&data);
     }
-    if (sample_percentage >= 0) {
-      read_session->mutable_read_options()->
-        set_sample_percentage(sample_percentage);
+    return &data_;
+  }
+
+  void swap(Payload& other) {
+    slices_.swap(other.slices_);
+    data_.swap(other.data_);
+    std::swap(size_, other.size_);
+  }
+
+  void clear() {
+    std::vector<grpc::Slice>().swap(slices_);
+    std::string().swap(data_);
+    size_ = 0;
+  }
+
+private:
+  std::vector<grpc::Slice> slices_;
+  std::string data_;
+  std::size_t size_ = 0;
+};
+
+// A ReadRows response with every field but the record batch, which is left
+// in the received buffer
+struct ReadRowsPage {
+  ReadRowsResponse response;
+  Payload batch;
+};
+
+// Walks the protobuf wire format of a message spread over slices
+class WireReader {
+public:
+  explicit WireReader(const std::vector<grpc::Slice>& slices)
+    : slices_(slices) {
+    for (const grpc::Slice& slice : slices_) {
+      size_ += slice.size();
     }
-    method_request.set_parent("projects/" + parent);
-    grpc::ClientContext context;
-    context.AddMetadata("x-goog-request-params",
-                        "read_session.table=" + table_fullname);
-    context.AddMetadata("x-goog-api-client", client_info_);
-    ReadSession method_response;
+  }
 
-    // The actual RPC.
-    grpc::Status status = stub_->
-      CreateReadSession(&context, method_request, &method_response);
-    if (!status.ok()) {
-      std::string err;
-      err += "gRPC method CreateReadSession error -> ";
-      err += status.error_message();
-      Rcpp::stop(err.c_str());
+  std::size_t position() const { return pos_; }
+  std::size_t left() const { return size_ - pos_; }
+
+  bool Varint(std::uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (left() == 0) {
+        return false;
+      }
+      while (offset_ == slices_[slice_].size()) {
+        slice_++;
+        offset_ = 0;
+      }
+      std::uint8_t byte = slices_[slice_].begin()[offset_++];
+      pos_++;
+      *value |= std::uint64_t(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
     }
-    return method_response;
+    return false;
   }
 
-  // Read rows from a stream
-  void ReadRows(const std::string stream,
-                std::vector<uint8_t>* ipc_stream,
-                std::int64_t& n,
-                long int& rows_count,
-                long int& pages_count,
-                bool quiet,
-                RProgress::RProgress* pb,
-                bool last_stream) {
+  bool Skip(std::uint64_t len) {
+    if (len > left()) {
+      return false;
+    }
+    pos_ += len;
+    while (len > 0) {
+      std::size_t part = std::min<std::uint64_t>(
+        len, slices_[slice_].size() - offset_);
+      offset_ += part;
+      len -= part;
+      if (len > 0) {
+        slice_++;
+        offset_ = 0;
+      }
+    }
+    return true;
+  }
 
-    grpc::ClientContext context;
-    context.AddMetadata("x-goog-request-params", "read_stream=" + stream);
-    context.AddMetadata("x-goog-api-client", client_info_);
+  // Skip the value of a field of the given wire type
+  bool SkipValue(int wire_type) {
+    std::uint64_t len;
+    switch (wire_type) {
+    case 0:
+      return Varint(&len);
+    case 1:
+      return Skip(8);
+    case 2:
+      return Varint(&len) && Skip(len);
+    case 5:
+      return Skip(4);
+    }
+    return false;
+  }
 
-    google::cloud::bigquery::storage::v1::ReadRowsRequest method_request;
-    method_request.set_read_stream(stream);
-    method_request.set_offset(0);
+  // Reference the bytes from begin to end as slices, or copy them to a
+  // string
+  void Slices(std::size_t begin, std::size_t end,
+              std::vector<grpc::Slice>* out) const {
+    std::size_t start = 0;
+    for (const grpc::Slice& slice : slices_) {
+      std::size_t stop = start + slice.size();
+      if (stop > begin && start < end) {
+        std::size_t from = std::max(begin, start) - start;
+        std::size_t to = std::min(end, stop) - start;
+        out->push_back(from == 0 && to == slice.size() ? slice :
+                       slice.sub(from, to));
+      }
+      start = stop;
+    }
+  }
+  void Append(std::size_t begin, std::size_t end, std::string* out) const {
+    std::vector<grpc::Slice> parts;
+    Slices(begin, end, &parts);
+    for (const grpc::Slice& part : parts) {
+      out->append(reinterpret_cast<const char*>(part.begin()), part.size());
+    }
+  }
 
-    google::cloud::bigquery::storage::v1::ReadRowsResponse method_response;
+private:
+  const std::vector<grpc::Slice>& slices_;
+  std::size_t size_ = 0;
+  std::size_t pos_ = 0;
+  std::size_t slice_ = 0;
+  std::size_t offset_ = 0;
+};
 
-    std::unique_ptr<grpc::ClientReader<google::cloud::bigquery::storage::v1::ReadRowsResponse> > reader(
-        stub_->ReadRows(&context, method_request));
+// Tags of ReadRowsResponse.arrow_record_batch and of its
+// serialized_record_batch, both length delimited
+const std::uint64_t arrow_record_batch_tag = (4 << 3) | 2;
+const std::uint64_t serialized_record_batch_tag = (1 << 3) | 2;
 
-    while (reader->Read(&method_response)) {
-      to_raw(method_response.arrow_record_batch().serialized_record_batch(),
-             ipc_stream);
-      method_request.set_offset(
-        method_request.offset() + method_response.row_count());
-      pages_count += 1;
-      if (!quiet) {
-        if (method_response.has_throttle_state()) {
-          pb->set_extra(method_response.throttle_state().throttle_percent());
-        }
-        if (n > 0) {
-          if (method_request.offset() + rows_count >= n) {
-          	context.TryCancel();
-            pb->update(1);
-            break;
-          }
-          pb->tick(method_response.row_count());
-        } else {
-          pb->tick(
-              (method_response.stats().progress().at_response_end()-
-               method_response.stats().progress().at_response_start()) * 200);
+// Split a serialized ReadRowsResponse: the record batch is referenced in the
+// slices and protobuf parses a copy of the other fields, a few dozen bytes
+// but for the schema sent with the first response
+bool parse_read_rows(const std::vector<grpc::Slice>& slices,
+                     ReadRowsPage* page) {
+  WireReader reader(slices);
+  std::vector<grpc::Slice> batch;
+  std::string rest;
+  while (reader.left() > 0) {
+    std::size_t start = reader.position();
+    std::uint64_t tag, len;
+    if (!reader.Varint(&tag)) {
+      return false;
+    }
+    if (tag != arrow_record_batch_tag) {
+      if (!reader.SkipValue(int(tag & 7))) {
+        return false;
+      }
+      reader.Append(start, reader.position(), &rest);
+      continue;
+    }
+    if (!reader.Varint(&len) || len > reader.left()) {
+      return false;
+    }
+    std::size_t end = reader.position() + len;
+    while (reader.position() < end) {
+      if (!reader.Varint(&tag)) {
+        return false;
+      }
+      if (tag != serialized_record_batch_tag) {
+        if (!reader.SkipValue(int(tag & 7))) {
+          return false;
         }
-      } else {
-      	if (n > 0) {
-      		if (method_request.offset() + rows_count >= n) {
-      			context.TryCancel();
-      			break;
-      		}
-      	}
+        continue;
       }
-      if (pages_count % 100 == 0L) {
-      	Rcpp::checkUserInterrupt();
+      if (!reader.Varint(&len) || len > end - reader.position()) {
+        return false;
       }
+      batch.clear();
+      reader.Slices(reader.position(), reader.position() + len, &batch);
+      reader.Skip(len);
     }
-    grpc::Status status = reader->Finish();
-    if ((n < 0 && !status.ok()) || (n > 0 && !(status.ok() || status.error_code() == grpc::StatusCode::CANCELLED))) {
-      std::string err;
-      err += "grpc method ReadRows error -> ";
-      err += status.error_message();
-      Rcpp::stop(err.c_str());
-    }
-    rows_count += method_request.offset();
-    if (last_stream && !quiet) {
-      pb->update(1);
+    if (reader.position() != end) {
+      return false;
     }
   }
+  page->batch.Assign(&batch);
+  return page->response.ParseFromString(rest);
+}
+
+// Parse a response received as a ByteBuffer, releasing the buffer. Record
+// batches go from the network buffers to their destination with a single
+// copy.
+grpc::Status parse_read_rows(grpc::ByteBuffer* buffer, ReadRowsPage* page) {
+  std::vector<grpc::Slice> slices;
+  grpc::Status status = buffer->Dump(&slices);
+  buffer->Clear();
+  if (!status.ok()) {
+    return status;
+  }
+  if (!parse_read_rows(slices, page)) {
+    return grpc::Status(grpc::StatusCode::INTERNAL,
+                        "Invalid ReadRowsResponse.");
+  }
+  return grpc::Status::OK;
+}
 
-  // Split stream
-  std::vector<std::string> SplitReadStream(
-      std::string& stream, double& fraction) {
+// Pages are coalesced into raw vectors of about this size before being
+// handed to R, so nanoarrow reads a few IPC streams instead of many tiny ones
+const std::size_t chunk_bytes = 16 * 1024 * 1024;
 
-    google::cloud::bigquery::storage::v1::SplitReadStreamRequest method_request;
-    method_request.set_name(stream);
-    method_request.set_fraction(fraction);
+// Copy pages into a raw vector holding a complete IPC stream starting with
+// the schema. The raw vector is allocated once at its final size and each
+// page is released as soon as it has been copied.
+Rcpp::RawVector ipc_chunk(const std::string& schema,
+                          std::vector<Payload>* pages) {
+  std::size_t size = schema.size();
+  for (const Payload& page : *pages) {
+    size += page.size();
+  }
+  Rcpp::RawVector chunk(Rcpp::no_init(size));
+  std::uint8_t* pos = chunk.begin();
+  std::memcpy(pos, schema.data(), schema.size());
+  pos += schema.size();
+  for (Payload& page : *pages) {
+    page.CopyTo(0, pos, page.size());
+    pos += page.size();
+    page.clear();
+  }
+  pages->clear();
+  return chunk;
+}
 
-    grpc::ClientContext context;
-    context.AddMetadata("x-goog-request-params",
-                        "name=" + stream);
-    context.AddMetadata("x-goog-api-client", client_info_);
-    google::cloud::bigquery::storage::v1::SplitReadStreamResponse method_response;
+// Cuts the record batches handed to R at n rows, n <= 0 meaning no limit.
+// Batches past the limit are dropped and the one crossing it is sliced, so
+// no surplus rows are decoded.
+class RowLimit {
+public:
+  RowLimit(const std::string& schema, std::int64_t n)
+    : schema_(schema), n_(n) {}
 
-    // The actual RPC.
-    grpc::Status status = stub_->
-      SplitReadStream(&context, method_request, &method_response);
-    if (!status.ok()) {
-      std::string err;
-      err += "gRPC method SplitReadStream error -> ";
-      err += status.error_message();
-      Rcpp::stop(err.c_str());
+  // Returns false when the page is past the limit and must be dropped
+  bool Take(std::string* page) {
+    if (n_ > 0 && rows_ >= n_) {
+      return false;
+    }
+    try {
+      std::int64_t rows = arrow_ipc::record_batch_rows(*page);
+      if (n_ > 0 && rows_ + rows > n_) {
+        if (fields_.empty()) {
+          fields_ = arrow_ipc::parse_schema(schema_);
+        }
+        if (arrow_ipc::slice_record_batch(page, fields_, n_ - rows_)) {
+          rows = n_ - rows_;
+        }
+      }
+      rows_ += rows;
+    } catch (const std::exception& e) {
+      // Left for nanoarrow to report
     }
+    return true;
+  }
 
-    return {method_response.primary_stream().name(),
-            method_response.remainder_stream().name()};
+  // Same for a page left in slices, only flattened when there is a limit.
+  // Its rows are not counted otherwise.
+  bool Take(Payload* page) {
+    return n_ <= 0 || Take(page->Flatten());
   }
+
+  // Rows taken so far
+  std::int64_t rows() const { return rows_; }
+
 private:
-  std::unique_ptr<BigQueryRead::Stub> stub_;
-  std::string client_info_;
+  const std::string& schema_;
+  std::int64_t n_;
+  std::int64_t rows_ = 0;
+  std::vector<arrow_ipc::Field> fields_;
 };
 
+// Replace an LZ4 frame compressed response payload by its content, sized
+// exactly from the response uncompressed_byte_size
+void decompress_response(std::string* payload, std::int64_t size) {
+  std::string out(std::size_t(size), '\0');
+  codec::decompress(codec::lz4_frame,
+                    reinterpret_cast<const std::uint8_t*>(payload->data()),
+                    payload->size(),
+                    reinterpret_cast<std::uint8_t*>(&out[0]), out.size());
+  payload->swap(out);
+}
 
+// Decompress a response record batch, throws on invalid data. Batches
+// without compression are left in their slices.
+void decode_response(ReadRowsPage* page, codec::Codec buffer_compression) {
+  const ReadRowsResponse& response = page->response;
+  // Response compression only applies when uncompressed_byte_size is set
+  // and positive, -1 means compression did not help and was skipped
+  bool compressed = response.has_uncompressed_byte_size() &&
+    response.uncompressed_byte_size() > 0;
+  if (!compressed && buffer_compression == codec::none) {
+    return;
+  }
+  std::string* batch = page->batch.Flatten();
+  if (compressed) {
+    decompress_response(batch, response.uncompressed_byte_size());
+  }
+  if (buffer_compression != codec::none) {
+    arrow_ipc::decompress_record_batch(batch);
+  }
+}
 
-// -- Credentials functions ----------------------------------------------------
+// Target volume of data read by one worker thread when sizing the pool from
+// the session estimated bytes scanned
+const std::int64_t bytes_per_worker = 64LL * 1024 * 1024;
 
-std::shared_ptr<grpc::ChannelCredentials> bqs_ssl(
-    std::string root_certificate) {
-  grpc::SslCredentialsOptions ssl_options;
-  if (!root_certificate.empty()) {
-    ssl_options.pem_root_certs = root_certificate;
+// Resolve "auto" (negative) stream counts from the number of worker threads.
+// At least one stream per worker, and a few more so faster workers can pick
+// up extra streams while slow ones finish.
+void auto_stream_count(int threads,
+                       std::int32_t* max_stream_count,
+                       std::int32_t* preferred_min_stream_count) {
+  if (*preferred_min_stream_count < 0) {
+    *preferred_min_stream_count = threads;
+  }
+  if (*max_stream_count < 0) {
+    *max_stream_count = std::max(4 * threads, *preferred_min_stream_count);
+  }
+  if (*max_stream_count > 0 &&
+      *preferred_min_stream_count > *max_stream_count) {
+    *preferred_min_stream_count = *max_stream_count;
   }
-  return grpc::SslCredentials(ssl_options);
 }
 
-std::shared_ptr<grpc::ChannelCredentials> bqs_credentials(
-    std::shared_ptr<grpc::ChannelCredentials> channel_cred,
-    std::shared_ptr<grpc::CallCredentials> call_cred = nullptr) {
-  if (channel_cred) {
-    if (call_cred) {
-      channel_cred = grpc::CompositeChannelCredentials(
-        channel_cred,
-        call_cred
-      );
-    }
+// Number of worker threads worth starting for a read session, no more than
+// the number of streams and roughly one per bytes_per_worker scanned
+int auto_threads(int threads, const ReadSession& read_session) {
+  std::int64_t bytes = read_session.estimated_total_bytes_scanned();
+  if (bytes > 0) {
+    std::int64_t workers = (bytes + bytes_per_worker - 1) / bytes_per_worker;
+    threads = int(std::min<std::int64_t>(threads, workers));
   }
-  return channel_cred == nullptr ? nullptr : channel_cred;
+  return std::max(1, std::min(threads, read_session.streams_size()));
 }
 
-std::shared_ptr<grpc::ChannelCredentials> bqs_google_credentials() {
-  auto gcp_cred = grpc::GoogleDefaultCredentials();
-  return bqs_credentials(gcp_cred);
-}
+// A broken ReadRows stream is re-opened at its current offset up to
+// resume_attempts times in a row without progress, with exponential backoff
+const int resume_attempts = 8;
+const std::chrono::milliseconds resume_backoff(250);
+const std::chrono::milliseconds resume_max_backoff(30000);
 
-std::shared_ptr<grpc::ChannelCredentials> bqs_refresh_token_credentials(
-    std::string refresh_token, std::string root_certificate = "") {
-  auto ssl_cred = bqs_ssl(root_certificate);
-  auto token_cred = grpc::GoogleRefreshTokenCredentials(refresh_token);
-  return bqs_credentials(ssl_cred, token_cred);
+// Statuses worth resuming a stream after: transient network errors, HTTP/2
+// resets surfaced as INTERNAL and, when the client renews its access token
+// during reads, expired credentials
+bool resumable(const grpc::Status& status, bool token_refresh) {
+  switch (status.error_code()) {
+  case grpc::StatusCode::UNAVAILABLE:
+    return true;
+  case grpc::StatusCode::UNAUTHENTICATED:
+    return token_refresh;
+  case grpc::StatusCode::INTERNAL:
+    return status.error_message().find("RST_STREAM") != std::string::npos ||
+      status.error_message().find("unexpected EOS") != std::string::npos;
+  default:
+    return false;
+  }
 }
 
-std::shared_ptr<grpc::ChannelCredentials> bqs_access_token_credentials(
-    std::string access_token, std::string root_certificate = "") {
-  auto ssl_cred = bqs_ssl(root_certificate);
-  auto token_cred = grpc::AccessTokenCredentials(access_token);
-  return bqs_credentials(ssl_cred, token_cred);
+// -- Read state ---------------------------------------------------------------
+
+// Streams are only split while they have at least this fraction left
+const double max_split_progress = 0.8;
+
+// Counters and timings of a read stream, in seconds since reading started.
+// The throttle history keeps each change of the server throttle percent.
+struct StreamMetrics {
+  std::string name;
+  std::int64_t rows = 0;
+  std::int64_t bytes = 0;
+  long int pages = 0;
+  double first_page = -1;
+  double finished = -1;
+  double stall = 0;
+  double decode = 0;
+  int retries = 0;
+  std::vector<std::pair<double, int> > throttle;
+};
+
+// Counters and timings of a whole read. Stall time is spent parked while
+// the consumer is behind or backing off before a retry, decode time
+// decompressing responses on worker threads, copy time handing pages over
+// to R. The peak is the most bytes ever waiting in the queue. Cache is
+// "hit" or "miss" for reads through the result cache.
+struct ReadMetrics {
+  std::string session;
+  std::string cache;
+  double session_seconds = 0;
+  double read_seconds = 0;
+  double copy_seconds = 0;
+  int splits = 0;
+  double memory_limit = 0;
+  std::size_t peak_queued = 0;
+  std::vector<StreamMetrics> streams;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+inline double seconds_since(Clock::time_point start) {
+  return std::chrono::duration<double>(Clock::now() - start).count();
 }
 
-// -- Client functions ---------------------------------------------------------
+// State of a single read stream. A stream split while being read continues
+// as its primary stream, and each remainder gets its own buffer. The newest
+// remainder holds the rows right after the parent's, so stream order visits
+// remainders from last to first.
+//
+// The weight is the share of the session the stream covers, and a split
+// hands the part after split_at over to the remainder. The share is what
+// the stream adds to the progress of the whole read so far.
+struct StreamBuffer {
+  std::int64_t rows = 0;
+  double progress = 0;
+  double weight = 0;
+  double share = 0;
+  double split_at = 1;
+  std::vector<int> remainders;
+  bool live = false;
+  bool split = false;
+  bool splittable = true;
+  StreamMetrics stats;
+};
 
-SEXP bqs_read_client(std::shared_ptr<grpc::ChannelCredentials> cred,
-                     std::string client_info,
-                     std::string service_configuration,
-                     std::string target) {
+// A stream waiting for a worker
+struct StreamTask {
+  std::string stream;
+  int index;
+  StreamBuffer* buffer;
+};
 
-  grpc::ChannelArguments channel_arguments;
-  channel_arguments.SetMaxReceiveMessageSize(104857600);
-  channel_arguments.SetServiceConfigJSON(service_configuration);
+// Where a queued page belongs in stream order: the index of its stream
+// buffer and its rank among the pages of that buffer
+struct PageInfo {
+  int buffer = 0;
+  long int seq = 0;
+  std::int64_t rows = 0;
+};
 
-  BigQueryReadClient *client = new BigQueryReadClient(
-    grpc::CreateCustomChannel(target, cred, channel_arguments)
-  );
+// A page waiting for the consumer
+struct QueuedPage {
+  Payload data;
+  PageInfo info;
+};
 
-  client->SetClientInfo(client_info);
+// A stream holding back its next Read until the consumer frees space
+struct ParkedStream {
+  StreamBuffer* buffer;
+  Clock::time_point since;
+  std::function<void()> wake;
+};
 
-  Rcpp::XPtr<BigQueryReadClient> ptr(client, true);
+// Wakes up a consumer taking pages from several read states. The count
+// goes up on each new page or finished stream of any of them. The states
+// also share memory_limit: it applies to the bytes queued by all of them.
+class ReadSignal {
+public:
+  void Notify() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    count_ += 1;
+    cv_.notify_all();
+  }
 
-  return ptr;
+  long int count() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return count_;
+  }
 
-}
+  // Wait until the count moved past seen
+  void Wait(long int seen, std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, timeout, [this, seen] { return count_ != seen; });
+  }
 
-// [[Rcpp::export(rng=false)]]
-SEXP bqs_client(std::string client_info,
-                std::string service_configuration,
-                std::string refresh_token = "",
-                std::string access_token = "",
-                std::string root_certificate = "",
-                std::string target = "bigquerystorage.googleapis.com:443") {
+  // Count bytes queued or taken by any of the states
+  void Queued(std::size_t added, std::size_t taken) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queued_ = queued_ + added - taken;
+    peak_queued_ = std::max(peak_queued_, queued_);
+  }
 
-  std::shared_ptr<grpc::ChannelCredentials> cred;
-  if (!refresh_token.empty()) {
-    cred = bqs_refresh_token_credentials(refresh_token,
-                                         readfile(root_certificate));
+  std::size_t queued() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queued_;
   }
-  if (!cred && !access_token.empty()) {
-    cred = bqs_access_token_credentials(access_token,
-                                        readfile(root_certificate));
+
+  std::size_t peak_queued() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_queued_;
   }
-  if (!cred) {
-    cred = bqs_google_credentials();
+
+private:
+  long int count_ = 0;
+  std::size_t queued_ = 0;
+  std::size_t peak_queued_ = 0;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+// State shared between the worker threads reading streams and the main
+// thread. Workers never touch R, the main thread polls the state to report
+// progress and check for user interrupts. Totals of the read are published
+// to atomics as well, so progress is sampled without taking the lock.
+//
+// Pages are queued in arrival order for the consumer on the main thread.
+// Once memory_limit bytes are queued, streams park after their current page
+// instead of asking for the next one, so HTTP/2 flow control holds the
+// server back, and the consumer wakes them up as it drains the queue.
+class ReadState {
+public:
+  ReadState(const ReadSession& read_session, std::int64_t n,
+            codec::Codec buffer_compression, std::size_t memory_limit,
+            ReadSignal* signal = NULL)
+    : n_(n), buffer_compression_(buffer_compression),
+      streams_(read_session.streams_size()), memory_limit_(memory_limit),
+      signal_(signal), session_(read_session.name()), start_(Clock::now()) {
+    for (int i = 0; i < streams_; i++) {
+      buffers_.emplace_back();
+      buffers_.back().weight = 1.0 / streams_;
+      buffers_.back().stats.name = read_session.streams(i).name();
+      tasks_.push_back({read_session.streams(i).name(), i, &buffers_.back()});
+    }
   }
-  if (!cred) {
-    Rcpp::stop("Could not create credentials.");
+
+  // Track a running call so it can be cancelled. Returns false when the
+  // read was already cancelled and the call should not be started.
+  bool Register(grpc::ClientContext* context) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cancelled_) {
+      return false;
+    }
+    contexts_.insert(context);
+    return true;
   }
 
-  return bqs_read_client(cred, client_info,
-                         readfile(service_configuration), target);
+  void Unregister(grpc::ClientContext* context) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    contexts_.erase(context);
+  }
 
-}
+  // Take the next stream to read. Returns 1 with a task, 0 when none is
+  // ready and -1 when there is nothing left to read. Once all streams are
+  // taken, the slowest live streams are asked to split, one for each idle
+  // reader.
+  int NextStream(StreamTask* task, int idle) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!tasks_.empty()) {
+      *task = tasks_.front();
+      tasks_.pop_front();
+      task->buffer->live = true;
+      return 1;
+    }
+    if (cancelled_ || live_streams() == 0) {
+      return -1;
+    }
+    int asked = 0;
+    for (const StreamBuffer& buffer : buffers_) {
+      asked += buffer.live && buffer.split;
+    }
+    for (; asked < idle; asked++) {
+      StreamBuffer* slowest = NULL;
+      for (StreamBuffer& buffer : buffers_) {
+        if (buffer.live && !buffer.split && buffer.splittable &&
+            buffer.progress < max_split_progress &&
+            (slowest == NULL || buffer.progress < slowest->progress)) {
+          slowest = &buffer;
+        }
+      }
+      if (slowest == NULL) {
+        break;
+      }
+      slowest->split = true;
+    }
+    return 0;
+  }
 
-// [[Rcpp::export(rng=false)]]
-SEXP bqs_ipc_stream(SEXP client,
-                    std::string project,
-                    std::string dataset,
-                    std::string table,
-                    std::string parent,
-                    std::int64_t n,
-                    std::vector<std::string> selected_fields,
-                    std::string row_restriction = "",
-                    std::double_t sample_percentage = -1,
-                    std::int64_t timestamp_seconds = 0,
-                    std::int32_t timestamp_nanos = 0,
-                    bool quiet = false) {
+  // Whether this stream was asked to split for an idle reader
+  bool SplitRequested(StreamBuffer* buffer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return buffer->split && !cancelled_;
+  }
 
-  Rcpp::XPtr<BigQueryReadClient> client_ptr(client);
+  // Fraction of the stream left unread to hand over, or a negative value
+  // when the stream is not worth splitting anymore
+  double SplitFraction(StreamBuffer* buffer) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buffer->progress >= max_split_progress) {
+      return -1;
+    }
+    return buffer->progress + (1 - buffer->progress) / 2;
+  }
 
-  std::vector<uint8_t> bytes;
-  long int rows_count = 0;
-  long int pages_count = 0;
-
-  // Retrieve ReadSession
-  ReadSession read_session = client_ptr->CreateReadSession(
-    project,
-    dataset,
-    table,
-    parent,
-    timestamp_seconds,
-    timestamp_nanos,
-    selected_fields,
-    row_restriction,
-    sample_percentage);
-  // Add schema to IPC stream
-  to_raw(read_session.arrow_schema().serialized_schema(), &bytes);
-
-  RProgress::RProgress pb(
-      "\033[42m\033[30mStreaming (:percent)\033[39m\033[49m [:bar] eta[:eta|:elapsed] throt[:extra]");
-  pb.set_cursor_char(">");
-  if (n > 0) {
-    pb.set_total(n);
-  } else {
-    pb.set_total(100 * read_session.streams_size());
-  }
-
-  // Add batches to IPC stream
-  for (int i = 0; i < read_session.streams_size(); i++) {
-    client_ptr->ReadRows(read_session.streams(i).name(), &bytes,
-                         n, rows_count, pages_count, quiet,
-                         &pb, i == read_session.streams_size() - 1);
-  	if (n > 0 && rows_count >= n) {
-  		break;
-  	}
+  // Clear a split request, with the fraction the stream was split at or a
+  // negative value. When the stream could not be split it is not asked
+  // again.
+  void SplitDone(StreamBuffer* buffer, double fraction) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buffer->split = false;
+    if (fraction > 0) {
+      buffer->progress = 0;
+      buffer->split_at = fraction;
+      splits_ += 1;
+    } else {
+      buffer->splittable = false;
+    }
   }
 
-  if (!quiet) {
-    REprintf("Streamed %ld rows in %ld messages.\n", rows_count, pages_count);
+  // Queue the remainder of a split stream for an idle reader, ordered right
+  // after its parent's rows. The parent keeps its share until its next page
+  // reports progress over the primary stream.
+  void AddRemainder(int parent, const std::string& stream) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int index = int(buffers_.size());
+    StreamBuffer& from = buffers_[parent];
+    double weight = from.weight * (1 - from.split_at);
+    from.weight -= weight;
+    from.split_at = 1;
+    buffers_.emplace_back();
+    buffers_.back().weight = weight;
+    buffers_.back().stats.name = stream;
+    buffers_[parent].remainders.push_back(index);
+    tasks_.push_back({stream, index, &buffers_.back()});
   }
 
-  // Return stream
-  return Rcpp::wrap(bytes);
+  // Move a page to the queue. Returns true when enough rows were received
+  // and the caller should stop reading.
+  bool AddPage(int index, StreamBuffer* buffer, Payload* page,
+               std::int64_t rows, double progress, int throttle,
+               double decode) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    StreamMetrics& stats = buffer->stats;
+    if (stats.first_page < 0) {
+      stats.first_page = seconds_since(start_);
+    }
+    stats.bytes += page->size();
+    stats.pages += 1;
+    stats.decode += decode;
+    if (throttle >= 0 &&
+        (stats.throttle.empty() || stats.throttle.back().second != throttle)) {
+      stats.throttle.emplace_back(seconds_since(start_), throttle);
+    }
+    queued_ += page->size();
+    peak_queued_ = std::max(peak_queued_, queued_);
+    if (signal_ != NULL) {
+      signal_->Queued(page->size(), 0);
+    }
+    queue_.emplace_back();
+    queue_.back().data.swap(*page);
+    queue_.back().info.buffer = index;
+    queue_.back().info.seq = stats.pages - 1;
+    queue_.back().info.rows = rows;
+    buffer->rows += rows;
+    buffer->progress = progress;
+    Advance(buffer, progress);
+    rows_ += rows;
+    bytes_ += queue_.back().data.size();
+    pages_ += 1;
+    if (throttle >= 0) {
+      throttle_ = throttle;
+    }
+    bool enough = n_ > 0 && rows_ >= n_;
+    if (enough) {
+      CancelLocked();
+    }
+    NotifyLocked();
+    return enough;
+  }
+
+  // Record the outcome of a finished stream, keeping the first error
+  void Finish(StreamBuffer* buffer, const grpc::Status& status) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!status.ok() && status_.ok()) {
+      status_ = status;
+      CancelLocked();
+    }
+    buffer->live = false;
+    buffer->split = false;
+    buffer->progress = 1;
+    Advance(buffer, 1);
+    buffer->stats.finished = seconds_since(start_);
+    finished_ += 1;
+    NotifyLocked();
+  }
+
+  void Cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CancelLocked();
+  }
+
+  // Park a stream while memory_limit bytes are queued. Returns false when
+  // the stream should go on reading, otherwise wake is called once, from
+  // any thread, when the consumer caught up or the read is cancelled.
+  bool Park(StreamBuffer* buffer, std::function<void()> wake) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (cancelled_ || QueuedLocked() < memory_limit_) {
+      return false;
+    }
+    parked_.push_back({buffer, Clock::now(), std::move(wake)});
+    return true;
+  }
+
+  // Count a retry of a stream, which backs off for backoff first
+  void Resumed(StreamBuffer* buffer, std::chrono::milliseconds backoff) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    resumed_ += 1;
+    buffer->stats.retries += 1;
+    buffer->stats.stall += std::chrono::duration<double>(backoff).count();
+  }
+
+  // Take the next queued page, with where it belongs in stream order when
+  // info is given. Returns 1 with a page, 0 on timeout and -1 once all
+  // streams are finished and the queue is drained.
+  int Pop(Payload* page, std::chrono::milliseconds timeout,
+          PageInfo* info = NULL) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait_for(lock, timeout, [this] {
+      return !queue_.empty() || done();
+    });
+    if (queue_.empty()) {
+      return done() ? -1 : 0;
+    }
+    page->swap(queue_.front().data);
+    if (info != NULL) {
+      *info = queue_.front().info;
+    }
+    queue_.pop_front();
+    queued_ -= page->size();
+    if (signal_ != NULL) {
+      signal_->Queued(0, page->size());
+    }
+    if (QueuedLocked() < memory_limit_) {
+      WakeLocked();
+    }
+    return 1;
+  }
+
+  // Wake up parked streams once the reads sharing the signal are back
+  // under memory_limit, the consumer frees space in other queues too
+  void Resume() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (QueuedLocked() < memory_limit_) {
+      WakeLocked();
+    }
+  }
+
+  // Same, with the page copied out of its slices on the calling thread
+  int Pop(std::string* page, std::chrono::milliseconds timeout,
+          PageInfo* info = NULL) {
+    Payload payload;
+    int ret = Pop(&payload, timeout, info);
+    if (ret > 0) {
+      page->swap(*payload.Flatten());
+    }
+    return ret;
+  }
+
+  bool Cancelled() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return cancelled_;
+  }
+
+  // Wait for progress, returns true once all streams are finished
+  bool Wait(std::chrono::milliseconds timeout) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, timeout, [this] { return done(); });
+  }
+
+  // Fraction of the read done, between 0 and 1: the progress of the
+  // streams weighted by the share of the session they cover, or the rows
+  // received out of n when that is further. Does not take the lock.
+  double Progress() const {
+    if (streams_ == 0) {
+      return 1;
+    }
+    double progress = progress_.load(std::memory_order_relaxed);
+    if (n_ > 0) {
+      progress = std::max(progress, double(rows()) / n_);
+    }
+    return std::min(progress, 1.0);
+  }
+
+  // Indices of the stream buffers in stream order, remainders of split
+  // streams in place. Only valid once all workers are done.
+  std::vector<int> StreamOrder() {
+    std::vector<int> order;
+    for (int i = 0; i < streams_; i++) {
+      CollectBuffers(i, &order);
+    }
+    return order;
+  }
+
+  // Counters of the read so far, remainders of split streams last
+  ReadMetrics Stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ReadMetrics stats;
+    stats.session = session_;
+    stats.read_seconds = seconds_since(start_);
+    stats.splits = splits_;
+    stats.memory_limit = double(memory_limit_);
+    stats.peak_queued = peak_queued_;
+    double last = 0;
+    for (const StreamBuffer& buffer : buffers_) {
+      stats.streams.push_back(buffer.stats);
+      stats.streams.back().rows = buffer.rows;
+      last = std::max(last, buffer.stats.finished);
+    }
+    if (done()) {
+      stats.read_seconds = last;
+    }
+    return stats;
+  }
+
+  std::int64_t n() const { return n_; }
+  int streams() const { return streams_; }
+  codec::Codec buffer_compression() const { return buffer_compression_; }
+  std::int64_t rows() const { return rows_.load(std::memory_order_relaxed); }
+  std::int64_t bytes() const { return bytes_.load(std::memory_order_relaxed); }
+  long int pages() { std::lock_guard<std::mutex> lock(mutex_); return pages_; }
+  int throttle() const { return throttle_.load(std::memory_order_relaxed); }
+  int resumed() { std::lock_guard<std::mutex> lock(mutex_); return resumed_; }
+  int splits() { std::lock_guard<std::mutex> lock(mutex_); return splits_; }
+  grpc::Status status() { std::lock_guard<std::mutex> lock(mutex_); return status_; }
+
+private:
+  void CancelLocked() {
+    if (!cancelled_) {
+      cancelled_ = true;
+      for (grpc::ClientContext* context : contexts_) {
+        context->TryCancel();
+      }
+      WakeLocked();
+      NotifyLocked();
+    }
+  }
+
+  void NotifyLocked() {
+    cv_.notify_all();
+    if (signal_ != NULL) {
+      signal_->Notify();
+    }
+  }
+
+  // Bytes counted against memory_limit
+  std::size_t QueuedLocked() {
+    return signal_ != NULL ? signal_->queued() : queued_;
+  }
+
+  void WakeLocked() {
+    for (ParkedStream& parked : parked_) {
+      parked.buffer->stats.stall += seconds_since(parked.since);
+      parked.wake();
+    }
+    parked_.clear();
+  }
+
+  // Publish the progress of a stream, over the part it still covers
+  void Advance(StreamBuffer* buffer, double progress) {
+    double share = buffer->weight * std::min(std::max(progress, 0.0), 1.0);
+    progress_sum_ += share - buffer->share;
+    buffer->share = share;
+    progress_.store(progress_sum_, std::memory_order_relaxed);
+  }
+
+  bool done() const { return finished_ >= int(buffers_.size()); }
+
+  int live_streams() const {
+    return int(buffers_.size()) - finished_ - int(tasks_.size());
+  }
+
+  void CollectBuffers(int index, std::vector<int>* order) {
+    order->push_back(index);
+    const StreamBuffer& buffer = buffers_[index];
+    for (auto it = buffer.remainders.rbegin();
+         it != buffer.remainders.rend(); ++it) {
+      CollectBuffers(*it, order);
+    }
+  }
+
+  std::int64_t n_;
+  codec::Codec buffer_compression_;
+  // Written under the lock, read without it
+  std::atomic<std::int64_t> rows_{0};
+  std::atomic<std::int64_t> bytes_{0};
+  std::atomic<int> throttle_{0};
+  std::atomic<double> progress_{0};
+  double progress_sum_ = 0;
+  long int pages_ = 0;
+  int finished_ = 0;
+  int resumed_ = 0;
+  int splits_ = 0;
+  bool cancelled_ = false;
+  grpc::Status status_;
+  std::set<grpc::ClientContext*> contexts_;
+  // A deque keeps buffers in place as remainders are added
+  std::deque<StreamBuffer> buffers_;
+  int streams_;
+  std::deque<StreamTask> tasks_;
+  std::size_t memory_limit_;
+  std::size_t queued_ = 0;
+  std::size_t peak_queued_ = 0;
+  std::deque<QueuedPage> queue_;
+  std::vector<ParkedStream> parked_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  ReadSignal* signal_;
+  std::string session_;
+  Clock::time_point start_;
+};
+
+// Positions of pages taken in arrival order, in stream order given the
+// stream buffers in stream order, or as they arrived
+std::vector<std::size_t> page_sequence(const std::vector<PageInfo>& arrival,
+                                       bool ordered,
+                                       const std::vector<int>& buffers) {
+  std::vector<std::size_t> sequence;
+  if (!ordered) {
+    for (std::size_t i = 0; i < arrival.size(); i++) {
+      sequence.push_back(i);
+    }
+    return sequence;
+  }
+  std::vector<std::vector<std::size_t> > by_buffer;
+  for (std::size_t i = 0; i < arrival.size(); i++) {
+    const PageInfo& info = arrival[i];
+    if (by_buffer.size() <= std::size_t(info.buffer)) {
+      by_buffer.resize(info.buffer + 1);
+    }
+    std::vector<std::size_t>& pages = by_buffer[info.buffer];
+    if (pages.size() <= std::size_t(info.seq)) {
+      pages.resize(info.seq + 1, arrival.size());
+    }
+    pages[info.seq] = i;
+  }
+  for (int buffer : buffers) {
+    if (std::size_t(buffer) >= by_buffer.size()) {
+      continue;
+    }
+    for (std::size_t i : by_buffer[buffer]) {
+      if (i < arrival.size()) {
+        sequence.push_back(i);
+      }
+    }
+  }
+  return sequence;
+}
+
+// -- Progress reporter --------------------------------------------------------
+
+// How often progress is drawn and user interrupts are checked
+const std::chrono::milliseconds report_interval(200);
+
+// Throughput is smoothed over about this many seconds
+const double rate_window = 5;
+
+// Draws the progress of a read from the main thread. Workers only publish
+// totals to the read state, and Sample() reads them at most once per
+// interval, so the cost of the display does not grow with the number of
+// pages. The rate and ETA follow the recent throughput of all streams
+// rather than the time since the start of the read. Several reads count
+// as much each.
+class ProgressReporter {
+public:
+  ProgressReporter(const ReadState* state, bool quiet)
+    : ProgressReporter(std::vector<const ReadState*>(1, state), quiet) {}
+  ProgressReporter(const std::vector<const ReadState*>& states, bool quiet)
+    : states_(states), quiet_(quiet), last_(Clock::now()),
+      pb_("\033[42m\033[30mStreaming (:percent)\033[39m\033[49m [:bar] "
+          "eta[:eta|:elapsed] :rate throt[:extra]") {
+    pb_.set_cursor_char(">");
+    pb_.set_total(100);
+  }
+
+  // Draw the progress once the interval elapsed since the last sample.
+  // Returns true when it did, for the caller to check user interrupts.
+  bool Sample() {
+    Clock::time_point now = Clock::now();
+    if (now - last_ < report_interval) {
+      return false;
+    }
+    double dt = std::chrono::duration<double>(now - last_).count();
+    last_ = now;
+    double progress = states_.empty() ? 1 : 0;
+    double bytes = 0;
+    int throttle = 0;
+    for (const ReadState* state : states_) {
+      progress += state->Progress() / states_.size();
+      bytes += double(state->bytes());
+      throttle = std::max(throttle, state->throttle());
+    }
+    double weight = sampled_ ? 1 - std::exp(-dt / rate_window) : 1;
+    rate_ += weight * ((bytes - bytes_) / dt - rate_);
+    speed_ += weight * ((progress - progress_) / dt - speed_);
+    bytes_ = bytes;
+    progress_ = progress;
+    sampled_ = true;
+    if (!quiet_ && progress > ratio_ && progress < 1) {
+      ratio_ = progress;
+      pb_.set_extra(throttle);
+      pb_.set_rate(rate_);
+      pb_.set_eta(speed_ > 0 ? (1 - progress) / speed_ : INFINITY);
+      pb_.update(ratio_);
+    }
+    return true;
+  }
+
+  // Draw the finished bar
+  void Done() {
+    if (!quiet_) {
+      pb_.update(1);
+    }
+  }
+
+private:
+  std::vector<const ReadState*> states_;
+  bool quiet_;
+  bool sampled_ = false;
+  Clock::time_point last_;
+  double ratio_ = 0;
+  double progress_ = 0;
+  double bytes_ = 0;
+  double rate_ = 0;
+  double speed_ = 0;
+  RProgress::RProgress pb_;
+};
+
+// -- Access token -------------------------------------------------------------
+
+// Access tokens are renewed this long before they expire, and a failed
+// renewal is tried again after token_retry
+const std::chrono::seconds token_margin(300);
+const std::chrono::seconds token_retry(30);
+
+// Access token shared by the calls of a client. It is replaced in place from
+// R, so the client and its channels outlive the token they started with.
+class TokenStore {
+public:
+  explicit TokenStore(const std::string& token) : token_(token) {}
+  // Set the token, valid for expires_in seconds, unknown when not positive
+  void Set(const std::string& token, double expires_in) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    token_ = token;
+    expires_ = expires_in > 0 ?
+      std::chrono::system_clock::now() +
+        std::chrono::seconds(std::int64_t(expires_in)) :
+      std::chrono::system_clock::time_point();
+    attempt_ = std::chrono::system_clock::time_point();
+  }
+  std::string Get() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return token_;
+  }
+  // Whether a token of known lifetime is due for renewal. Counts as an
+  // attempt, so a failing renewal is not retried before token_retry.
+  bool Expiring() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto now = std::chrono::system_clock::now();
+    if (expires_ == std::chrono::system_clock::time_point() ||
+        now < expires_ - token_margin || now < attempt_ + token_retry) {
+      return false;
+    }
+    attempt_ = now;
+    return true;
+  }
+  void SetRefreshable(bool refreshable) { refreshable_ = refreshable; }
+  bool refreshable() const { return refreshable_; }
+private:
+  std::mutex mutex_;
+  std::string token_;
+  std::chrono::system_clock::time_point expires_;
+  std::chrono::system_clock::time_point attempt_;
+  std::atomic<bool> refreshable_{false};
+};
+
+// Adds the current access token of a store to each call. Non blocking, it
+// never waits on R: the main thread renews the token while it polls reads,
+// and a call that went out with an expired token fails with UNAUTHENTICATED
+// and is resumed with the new one.
+class AccessTokenPlugin : public grpc::MetadataCredentialsPlugin {
+public:
+  explicit AccessTokenPlugin(std::shared_ptr<TokenStore> store)
+    : store_(store) {}
+  bool IsBlocking() const override { return false; }
+  const char* GetType() const override { return "bigrquerystorage"; }
+  grpc::Status GetMetadata(
+      grpc::string_ref service_url, grpc::string_ref method_name,
+      const grpc::AuthContext& channel_auth_context,
+      std::multimap<grpc::string, grpc::string>* metadata) override {
+    std::string token = store_->Get();
+    if (token.empty()) {
+      return grpc::Status(grpc::StatusCode::UNAUTHENTICATED,
+                          "No access token.");
+    }
+    metadata->insert(std::make_pair("authorization", "Bearer " + token));
+    return grpc::Status::OK;
+  }
+private:
+  std::shared_ptr<TokenStore> store_;
+};
+
+// -- Client class -------------------------------------------------------------
+
+// Options of a read session, as given to the client functions
+struct SessionRequest {
+  std::string project;
+  std::string dataset;
+  std::string table;
+  std::string parent;
+  std::vector<std::string> selected_fields;
+  std::string row_restriction;
+  std::double_t sample_percentage = -1;
+  std::int64_t timestamp_seconds = 0;
+  std::int32_t timestamp_nanos = 0;
+  std::int32_t max_stream_count = 0;
+  std::int32_t preferred_min_stream_count = 0;
+  codec::Codec buffer_compression = codec::none;
+  codec::Codec response_compression = codec::none;
+};
+
+// Full name of the ReadRows method, called through a generic stub to
+// receive responses as ByteBuffer
+const char* const read_rows_method =
+  "/google.cloud.bigquery.storage.v1.BigQueryRead/ReadRows";
+
+class BigQueryReadClient {
+public:
+  BigQueryReadClient(
+      const std::vector<std::shared_ptr<grpc::Channel> >& channels)
+    : calls_(channels.size(), 0) {
+    for (const auto& channel : channels) {
+      stubs_.push_back(BigQueryRead::NewStub(channel));
+      generic_.emplace_back(new grpc::GenericStub(channel));
+    }
+  }
+  void SetClientInfo(const std::string &client_info) {
+    client_info_ = client_info;
+  }
+  void SetTokenStore(std::shared_ptr<TokenStore> token) {
+    token_ = token;
+  }
+  // Replace the access token used by new calls, valid for expires_in
+  // seconds. refresh, when not NULL, is an R function returning a new token
+  // and its expires_in, called by RefreshToken. Returns false when the
+  // client does not authenticate with an access token.
+  bool SetToken(const std::string& token, double expires_in, SEXP refresh) {
+    if (!token_) {
+      return false;
+    }
+    token_->Set(token, expires_in);
+    refresh_ = refresh;
+    token_->SetRefreshable(refresh != R_NilValue);
+    return true;
+  }
+  // Whether calls failing with UNAUTHENTICATED will see a new token
+  bool RefreshesToken() const { return token_ && token_->refreshable(); }
+  // Renew the access token once it is about to expire. Main thread only,
+  // called while reads are polled, so long reads outlive their first token.
+  // A failing renewal only warns, calls keep the old token until it works.
+  void RefreshToken() {
+    if (refresh_ == R_NilValue || !token_->Expiring()) {
+      return;
+    }
+    try {
+      Rcpp::Function refresh(refresh_);
+      Rcpp::List token = refresh();
+      token_->Set(Rcpp::as<std::string>(token["access_token"]),
+                  Rcpp::as<double>(token["expires_in"]));
+    } catch (const Rcpp::eval_error& e) {
+      Rcpp::warning("Could not renew the access token: %s", e.what());
+    }
+  }
+
+  // Counters of the last read made with this client
+  void SetStats(const ReadMetrics& stats) { stats_ = stats; }
+  const ReadMetrics& stats() const { return stats_; }
+
+  // Creation read sessions. Runs on any thread, the call can be cancelled
+  // through context.
+  grpc::Status CreateReadSession(const SessionRequest& request,
+                                 grpc::ClientContext* context,
+                                 ReadSession* method_response) {
+    google::cloud::bigquery::storage::v1::CreateReadSessionRequest method_request;
+    ReadSession *read_session = method_request.mutable_read_session();
+    std::string table_fullname =
+      "projects/" + request.project + "/datasets/" + request.dataset +
+      "/tables/" + request.table;
+    read_session->set_table(table_fullname);
+    read_session->set_data_format(
+        google::cloud::bigquery::storage::v1::DataFormat::ARROW);
+    if (request.timestamp_seconds > 0 || request.timestamp_nanos > 0) {
+      read_session->mutable_table_modifiers()->
+        mutable_snapshot_time()->set_seconds(request.timestamp_seconds);
+      read_session->mutable_table_modifiers()->
+        mutable_snapshot_time()->set_nanos(request.timestamp_nanos);
+    }
+    for (int i = 0; i < int(request.selected_fields.size()); i++) {
+      read_session->mutable_read_options()->
+        add_selected_fields(request.selected_fields[i]);
+    }
+    if (!request.row_restriction.empty()) {
+      read_session->mutable_read_options()->
+        set_row_restriction(request.row_restriction);
+    }
+    if (request.sample_percentage >= 0) {
+      read_session->mutable_read_options()->
+        set_sample_percentage(request.sample_percentage);
+    }
+    if (request.buffer_compression != codec::none) {
+      read_session->mutable_read_options()->
+        mutable_arrow_serialization_options()->
+        set_buffer_compression(request.buffer_compression == codec::lz4_frame ?
+          ArrowSerializationOptions::LZ4_FRAME : ArrowSerializationOptions::ZSTD);
+    }
+    if (request.response_compression == codec::lz4_frame) {
+      read_session->mutable_read_options()->set_response_compression_codec(
+        ReadSession::TableReadOptions::RESPONSE_COMPRESSION_CODEC_LZ4);
+    }
+    method_request.set_parent("projects/" + request.parent);
+    method_request.set_max_stream_count(request.max_stream_count);
+    method_request.set_preferred_min_stream_count(request.preferred_min_stream_count);
+    context->AddMetadata("x-goog-request-params",
+                         "read_session.table=" + table_fullname);
+    context->AddMetadata("x-goog-api-client", client_info_);
+
+    // The actual RPC.
+    return stubs_[0]->
+      CreateReadSession(context, method_request, method_response);
+  }
+
+  int channels() const { return stubs_.size(); }
+
+  // Pick the channel with the fewest open ReadRows calls. Each call must be
+  // given back with ReleaseChannel once finished.
+  int AcquireChannel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    int channel = 0;
+    for (int i = 1; i < int(calls_.size()); i++) {
+      if (calls_[i] < calls_[channel]) {
+        channel = i;
+      }
+    }
+    calls_[channel]++;
+    return channel;
+  }
+  void ReleaseChannel(int channel) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    calls_[channel]--;
+  }
+
+  // Prepare an asynchronous ReadRows call of a stream from offset on an
+  // acquired channel, to be started with StartCall before request is
+  // written. Responses are received as ByteBuffer, so record batches can be
+  // left in the gRPC slices.
+  std::unique_ptr<grpc::GenericClientAsyncReaderWriter> PrepareReadRows(
+      grpc::ClientContext* context,
+      const std::string& stream,
+      std::int64_t offset,
+      grpc::CompletionQueue* cq,
+      int channel,
+      grpc::ByteBuffer* request) {
+
+    context->AddMetadata("x-goog-request-params", "read_stream=" + stream);
+    context->AddMetadata("x-goog-api-client", client_info_);
+
+    google::cloud::bigquery::storage::v1::ReadRowsRequest method_request;
+    method_request.set_read_stream(stream);
+    method_request.set_offset(offset);
+
+    grpc::Slice slice(method_request.SerializeAsString());
+    grpc::ByteBuffer(&slice, 1).Swap(request);
+    return generic_[channel]->PrepareCall(context, read_rows_method, cq);
+  }
+
+  // Split a stream at fraction of its rows into a primary and a remainder
+  // stream. Runs on a worker thread. Empty names mean the stream can not be
+  // split further.
+  grpc::Status SplitReadStream(const std::string& stream,
+                               double fraction,
+                               std::string* primary,
+                               std::string* remainder,
+                               ReadState* state) {
+
+    google::cloud::bigquery::storage::v1::SplitReadStreamRequest method_request;
+    method_request.set_name(stream);
+    method_request.set_fraction(fraction);
+
+    grpc::ClientContext context;
+    context.AddMetadata("x-goog-request-params",
+                        "name=" + stream);
+    context.AddMetadata("x-goog-api-client", client_info_);
+    if (!state->Register(&context)) {
+      return grpc::Status::CANCELLED;
+    }
+    google::cloud::bigquery::storage::v1::SplitReadStreamResponse method_response;
+
+    // The actual RPC.
+    grpc::Status status = stubs_[0]->
+      SplitReadStream(&context, method_request, &method_response);
+    state->Unregister(&context);
+    if (status.ok()) {
+      *primary = method_response.primary_stream().name();
+      *remainder = method_response.remainder_stream().name();
+    }
+    return status;
+  }
+private:
+  std::vector<std::unique_ptr<BigQueryRead::Stub> > stubs_;
+  std::vector<std::unique_ptr<grpc::GenericStub> > generic_;
+  std::vector<int> calls_;
+  std::mutex mutex_;
+  std::string client_info_;
+  std::shared_ptr<TokenStore> token_;
+  Rcpp::RObject refresh_;
+  ReadMetrics stats_;
+};
+
+
+
+// Create a read session, resolving "auto" stream counts and the number of
+// worker threads worth starting for it. Runs on any thread.
+grpc::Status open_read_session(BigQueryReadClient* client,
+                               SessionRequest request,
+                               grpc::ClientContext* context,
+                               int* threads,
+                               ReadSession* read_session,
+                               double* seconds) {
+  if (*threads <= 0) {
+    *threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  auto_stream_count(*threads, &request.max_stream_count,
+                    &request.preferred_min_stream_count);
+
+  Clock::time_point start = Clock::now();
+  grpc::Status status =
+    client->CreateReadSession(request, context, read_session);
+  *seconds = seconds_since(start);
+
+  if (status.ok() && *threads > 1) {
+    *threads = auto_threads(*threads, *read_session);
+  }
+  return status;
+}
+
+// Read sessions created at once by a SessionBatch
+const int session_concurrency = 16;
+
+// Creates read sessions for several tables on a few threads at once, each
+// resolving its own stream counts and worker threads. Destruction cancels
+// pending calls and joins the threads, so an R interrupt on the main thread
+// leaves no thread behind.
+class SessionBatch {
+public:
+  SessionBatch(BigQueryReadClient* client,
+               const std::vector<SessionRequest>& requests,
+               int threads)
+    : client_(client), requests_(requests),
+      contexts_(new grpc::ClientContext[requests.size()]),
+      threads_(requests.size(), threads), sessions_(requests.size()),
+      statuses_(requests.size()), start_(Clock::now()) {
+    std::size_t workers = std::min(requests.size(),
+                                   std::size_t(session_concurrency));
+    for (std::size_t t = 0; t < workers; t++) {
+      workers_.emplace_back([this]() { Run(); });
+    }
+  }
+  ~SessionBatch() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cancelled_ = true;
+      for (std::size_t i = 0; i < requests_.size(); i++) {
+        contexts_[i].TryCancel();
+      }
+    }
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Wait for all sessions from the main thread, checking for user
+  // interrupts. Returns the time taken.
+  double Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (finished_ < requests_.size()) {
+      cv_.wait_for(lock, std::chrono::milliseconds(100));
+      lock.unlock();
+      Rcpp::checkUserInterrupt();
+      lock.lock();
+    }
+    return seconds_since(start_);
+  }
+
+  const ReadSession& session(std::size_t i) const { return sessions_[i]; }
+  const grpc::Status& status(std::size_t i) const { return statuses_[i]; }
+  int threads(std::size_t i) const { return threads_[i]; }
+
+private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (next_ < requests_.size() && !cancelled_) {
+      std::size_t i = next_++;
+      lock.unlock();
+      double seconds;
+      grpc::Status status = open_read_session(
+        client_, requests_[i], &contexts_[i], &threads_[i], &sessions_[i],
+        &seconds);
+      lock.lock();
+      statuses_[i] = status;
+      finished_ += 1;
+      cv_.notify_all();
+    }
+  }
+
+  BigQueryReadClient* client_;
+  const std::vector<SessionRequest>& requests_;
+  std::unique_ptr<grpc::ClientContext[]> contexts_;
+  std::vector<int> threads_;
+  std::vector<ReadSession> sessions_;
+  std::vector<grpc::Status> statuses_;
+  std::size_t next_ = 0;
+  std::size_t finished_ = 0;
+  bool cancelled_ = false;
+  Clock::time_point start_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<std::thread> workers_;
+};
+
+// -- Credentials functions ----------------------------------------------------
+
+std::shared_ptr<grpc::ChannelCredentials> bqs_ssl(
+    std::string root_certificate) {
+  grpc::SslCredentialsOptions ssl_options;
+  if (!root_certificate.empty()) {
+    ssl_options.pem_root_certs = root_certificate;
+  }
+  return grpc::SslCredentials(ssl_options);
+}
+
+std::shared_ptr<grpc::ChannelCredentials> bqs_credentials(
+    std::shared_ptr<grpc::ChannelCredentials> channel_cred,
+    std::shared_ptr<grpc::CallCredentials> call_cred = nullptr) {
+  if (channel_cred) {
+    if (call_cred) {
+      channel_cred = grpc::CompositeChannelCredentials(
+        channel_cred,
+        call_cred
+      );
+    }
+  }
+  return channel_cred == nullptr ? nullptr : channel_cred;
+}
+
+std::shared_ptr<grpc::ChannelCredentials> bqs_google_credentials() {
+  auto gcp_cred = grpc::GoogleDefaultCredentials();
+  return bqs_credentials(gcp_cred);
+}
+
+std::shared_ptr<grpc::ChannelCredentials> bqs_refresh_token_credentials(
+    std::string refresh_token, std::string root_certificate = "") {
+  auto ssl_cred = bqs_ssl(root_certificate);
+  auto token_cred = grpc::GoogleRefreshTokenCredentials(refresh_token);
+  return bqs_credentials(ssl_cred, token_cred);
+}
+
+std::shared_ptr<grpc::ChannelCredentials> bqs_access_token_credentials(
+    std::shared_ptr<TokenStore> store, std::string root_certificate = "") {
+  auto ssl_cred = bqs_ssl(root_certificate);
+  auto token_cred = grpc::MetadataCredentialsFromPlugin(
+    std::unique_ptr<grpc::MetadataCredentialsPlugin>(
+      new AccessTokenPlugin(store)));
+  return bqs_credentials(ssl_cred, token_cred);
+}
+
+// -- Worker pool --------------------------------------------------------------
+
+// Streams read at once by each poller thread. gRPC allows one pending Read
+// per call, so this is the in-flight read budget of a thread.
+const int streams_per_thread = 4;
+
+// Interval at which a stream waiting to resume checks for cancellation
+const std::chrono::milliseconds resume_tick(200);
+
+// One read stream driven through the completion queue. Each Proceed handles
+// the completion of the pending operation and queues the next one.
+//
+// While the consumer is behind, the call parks after a page without a
+// pending Read, and is woken up through its alarm once space is freed.
+//
+// After a transient failure the stream is re-opened at the current offset
+// so rows already received are not fetched again. When asked to split,
+// reading pauses at the current offset and the stream is split; reading
+// goes on from the same offset on the primary stream, which starts with
+// the same rows. The remainder is handed over once the primary stream
+// accepted the offset, otherwise the split is given up and the original
+// stream is read to the end.
+class StreamCall {
+public:
+  StreamCall(BigQueryReadClient* client, ReadState* state,
+             grpc::CompletionQueue* cq, const StreamTask& task)
+    : client_(client), state_(state), cq_(cq), task_(task),
+      current_(task.stream) {}
+
+  // Open the call at the current offset. Returns false when reading was
+  // cancelled.
+  bool Start() {
+    // The reader lives in the arena of the previous call's context
+    reader_.reset();
+    context_.reset(new grpc::ClientContext());
+    if (!state_->Register(context_.get())) {
+      return false;
+    }
+    start_ = offset_;
+    channel_ = client_->AcquireChannel();
+    reader_ = client_->PrepareReadRows(context_.get(), current_, offset_, cq_,
+                                       channel_, &request_);
+    op_ = starting;
+    reader_->StartCall(this);
+    return true;
+  }
+
+  // Handle the completion of the pending operation. Returns false once the
+  // stream is done, with its outcome in status().
+  bool Proceed(bool ok) {
+    switch (op_) {
+    case starting:
+      return ok ? Write() : Finish();
+    case writing:
+      return ok ? Read() : Finish();
+    case reading:
+      return ok ? Page() : Finish();
+    case finishing:
+      state_->Unregister(context_.get());
+      client_->ReleaseChannel(channel_);
+      return Finished();
+    case waiting:
+      return Wait();
+    case parked:
+      return Next();
+    }
+    return false;
+  }
+
+  ReadState* state() const { return state_; }
+  StreamBuffer* buffer() const { return task_.buffer; }
+  const grpc::Status& status() const { return status_; }
+
+private:
+  enum Op { starting, writing, reading, finishing, waiting, parked };
+
+  bool Write() {
+    op_ = writing;
+    reader_->Write(request_, grpc::WriteOptions().set_last_message(), this);
+    return true;
+  }
+
+  bool Read() {
+    op_ = reading;
+    reader_->Read(&received_, this);
+    return true;
+  }
+
+  bool Finish() {
+    op_ = finishing;
+    reader_->Finish(&status_, this);
+    return true;
+  }
+
+  bool Page() {
+    grpc::Status parsed = parse_read_rows(&received_, &response_);
+    if (!parsed.ok()) {
+      error_ = parsed;
+      context_->TryCancel();
+      return Finish();
+    }
+    offset_ += response_.response.row_count();
+    Clock::time_point decode = Clock::now();
+    try {
+      decode_response(&response_, state_->buffer_compression());
+    } catch (const std::exception& e) {
+      error_ = grpc::Status(grpc::StatusCode::INTERNAL, e.what());
+      context_->TryCancel();
+      return Finish();
+    }
+    if (!remainder_.empty()) {
+      state_->AddRemainder(task_.index, remainder_);
+      remainder_.clear();
+    }
+    const ReadRowsResponse& response = response_.response;
+    bool enough = state_->AddPage(
+      task_.index, task_.buffer, &response_.batch, response.row_count(),
+      response.stats().progress().at_response_end(),
+      response.has_throttle_state() ?
+        response.throttle_state().throttle_percent() : -1,
+      seconds_since(decode));
+    if (enough) {
+      return Finish();
+    }
+    return Next();
+  }
+
+  // Split when asked to, otherwise read the next page unless parked. The
+  // call may be woken up on another thread as soon as it is parked, so op_
+  // is set first.
+  bool Next() {
+    if (state_->SplitRequested(task_.buffer)) {
+      paused_ = true;
+      context_->TryCancel();
+      return Finish();
+    }
+    op_ = parked;
+    if (state_->Park(task_.buffer, [this]() {
+          alarm_.reset(new grpc::Alarm());
+          alarm_->Set(cq_, std::chrono::system_clock::now(), this);
+        })) {
+      return true;
+    }
+    return Read();
+  }
+
+  bool Finished() {
+    grpc::Status status = error_.ok() ? status_ : error_;
+    error_ = grpc::Status::OK;
+    if (status.error_code() == grpc::StatusCode::CANCELLED &&
+        (paused_ || state_->Cancelled())) {
+      status = grpc::Status::OK;
+    }
+    if (paused_) {
+      paused_ = false;
+      Split();
+      return Restart();
+    }
+    if (status.ok() && !remainder_.empty()) {
+      state_->AddRemainder(task_.index, remainder_);
+      remainder_.clear();
+    }
+    bool resume = resumable(status, client_->RefreshesToken());
+    if (!status.ok() && !remainder_.empty() && !resume &&
+        !state_->Cancelled()) {
+      current_ = original_;
+      remainder_.clear();
+      return Restart();
+    }
+    if (status.ok() || !resume || state_->Cancelled()) {
+      return Done(status);
+    }
+    if (offset_ > start_) {
+      failures_ = 0;
+      backoff_ = resume_backoff;
+    }
+    if (++failures_ > resume_attempts) {
+      return Done(status);
+    }
+    resume_at_ = std::chrono::system_clock::now() + backoff_;
+    state_->Resumed(task_.buffer, backoff_);
+    backoff_ = std::min(backoff_ * 2, resume_max_backoff);
+    return Wait();
+  }
+
+  // Split what is left of the stream. Blocks this poller thread for the
+  // duration of the SplitReadStream call, which is short and rare.
+  void Split() {
+    std::string primary, rest;
+    double fraction = state_->SplitFraction(task_.buffer);
+    bool split = fraction > 0 && remainder_.empty() &&
+      client_->SplitReadStream(current_, fraction, &primary, &rest,
+                               state_).ok() &&
+      !primary.empty() && !rest.empty();
+    state_->SplitDone(task_.buffer, split ? fraction : -1);
+    if (split) {
+      original_ = current_;
+      current_ = primary;
+      remainder_ = rest;
+    }
+  }
+
+  // Back off before resuming, waking up regularly to notice cancellation
+  bool Wait() {
+    if (state_->Cancelled()) {
+      return Done(grpc::Status::OK);
+    }
+    std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
+    if (now >= resume_at_) {
+      return Restart();
+    }
+    op_ = waiting;
+    alarm_.reset(new grpc::Alarm());
+    alarm_->Set(cq_, std::min(resume_at_, now + resume_tick), this);
+    return true;
+  }
+
+  bool Restart() {
+    return Start() || Done(grpc::Status::OK);
+  }
+
+  bool Done(const grpc::Status& status) {
+    status_ = status;
+    return false;
+  }
+
+  BigQueryReadClient* client_;
+  ReadState* state_;
+  grpc::CompletionQueue* cq_;
+  StreamTask task_;
+  std::string current_;
+  std::string original_;
+  std::string remainder_;
+  std::int64_t offset_ = 0;
+  std::int64_t start_ = 0;
+  bool paused_ = false;
+  int channel_ = 0;
+  int failures_ = 0;
+  std::chrono::milliseconds backoff_ = resume_backoff;
+  std::chrono::system_clock::time_point resume_at_;
+  Op op_ = starting;
+  std::unique_ptr<grpc::ClientContext> context_;
+  std::unique_ptr<grpc::GenericClientAsyncReaderWriter> reader_;
+  std::unique_ptr<grpc::Alarm> alarm_;
+  grpc::ByteBuffer request_;
+  grpc::ByteBuffer received_;
+  ReadRowsPage response_;
+  grpc::Status status_;
+  grpc::Status error_;
+};
+
+// Reads all streams of a session on a few poller threads sharing one
+// completion queue, with up to streams_per_thread streams open per thread.
+// Streams are started as slots free up; once none are left and fewer
+// streams than threads are open, the slowest streams are asked to split.
+// Destruction cancels pending reads and joins the pollers, so an R
+// interrupt or error on the main thread leaves no thread behind.
+//
+// Several reads can share the pool, their sessions taking turns for free
+// slots, so the streams of small sessions keep the threads busy together.
+class ReadPool {
+public:
+  ReadPool(BigQueryReadClient* client,
+           const ReadSession& read_session,
+           ReadState* state,
+           int threads)
+    : ReadPool(client, std::vector<ReadState*>(1, state), threads) {}
+  ReadPool(BigQueryReadClient* client,
+           const std::vector<ReadState*>& states,
+           int threads) : client_(client), states_(states) {
+    int streams = 0;
+    for (ReadState* state : states_) {
+      streams += state->streams();
+    }
+    pollers_ = std::max(1, std::min(threads, streams));
+    slots_ = pollers_ * streams_per_thread;
+    Fill(NULL);
+    for (int t = 0; t < pollers_; t++) {
+      workers_.emplace_back([this]() { Poll(); });
+    }
+  }
+  ~ReadPool() {
+    for (ReadState* state : states_) {
+      state->Cancel();
+    }
+    for (std::thread& worker : workers_) {
+      worker.join();
+    }
+  }
+private:
+  void Poll() {
+    void* tag;
+    bool ok;
+    while (cq_.Next(&tag, &ok)) {
+      StreamCall* call = static_cast<StreamCall*>(tag);
+      if (call->Proceed(ok)) {
+        call = NULL;
+      }
+      Fill(call);
+    }
+  }
+
+  // Retire a finished call and start streams on free slots. The queue is
+  // shut down once nothing is left to read and no call is pending.
+  void Fill(StreamCall* done) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (done != NULL) {
+      done->state()->Finish(done->buffer(), done->status());
+      delete done;
+      active_ -= 1;
+    }
+    if (shutdown_) {
+      return;
+    }
+    StreamTask task;
+    ReadState* state;
+    int ret = 0;
+    while (active_ < slots_ && (ret = NextStream(&task, &state)) > 0) {
+      StreamCall* call = new StreamCall(client_, state, &cq_, task);
+      if (call->Start()) {
+        active_ += 1;
+      } else {
+        state->Finish(task.buffer, grpc::Status::OK);
+        delete call;
+      }
+    }
+    if (ret < 0 && active_ == 0) {
+      shutdown_ = true;
+      cq_.Shutdown();
+    }
+  }
+
+  // Take a stream from the reads in turn, same returns as
+  // ReadState::NextStream. When none is ready, idle readers split streams
+  // of the first read still going.
+  int NextStream(StreamTask* task, ReadState** state) {
+    int ret = -1;
+    std::size_t count = states_.size();
+    for (std::size_t i = 0; i < count; i++) {
+      ReadState* next = states_[(turn_ + i) % count];
+      int found = next->NextStream(task, 0);
+      if (found > 0) {
+        turn_ = (turn_ + i + 1) % count;
+        *state = next;
+        return 1;
+      }
+      ret = std::max(ret, found);
+    }
+    for (ReadState* next : states_) {
+      int found = next->NextStream(task, pollers_ - active_);
+      if (found > 0) {
+        *state = next;
+        return 1;
+      }
+      if (found == 0) {
+        break;
+      }
+    }
+    return ret;
+  }
+
+  BigQueryReadClient* client_;
+  std::vector<ReadState*> states_;
+  std::size_t turn_ = 0;
+  grpc::CompletionQueue cq_;
+  std::mutex mutex_;
+  int pollers_;
+  int slots_;
+  int active_ = 0;
+  bool shutdown_ = false;
+  std::vector<std::thread> workers_;
+};
+
+// -- Batch reader -------------------------------------------------------------
+
+// Serves a read session as an Arrow C stream of record batches, in arrival
+// order as the worker pool receives them. Streams park once read_ahead
+// bytes are waiting to be consumed. R is only called back, to check for
+// interrupts and refresh the token, when batches are pulled from the thread
+// that created the reader.
+class BatchReader {
+public:
+  BatchReader(SEXP client, const ReadSession& read_session, std::int64_t n,
+              codec::Codec buffer_compression, int threads,
+              std::size_t read_ahead, double session_seconds)
+    : client_(client),
+      read_session_(read_session),
+      session_seconds_(session_seconds),
+      main_thread_(std::this_thread::get_id()),
+      fields_(arrow_ipc::parse_schema(
+        read_session_.arrow_schema().serialized_schema())),
+      state_(read_session, n, buffer_compression,
+             read_ahead),
+      limit_(read_session_.arrow_schema().serialized_schema(), n) {
+    pool_.reset(new ReadPool(client_.get(), read_session_, &state_, threads));
+  }
+
+  void Schema(ArrowSchema* out) {
+    arrow_ipc::export_schema(fields_, out);
+  }
+
+  // Export the next record batch to out, left released at the end of the
+  // stream. Returns false on a read error.
+  bool Next(ArrowArray* out) {
+    out->release = NULL;
+    int ret;
+    while ((ret = state_.Pop(&page_, std::chrono::milliseconds(100))) == 0) {
+      if (std::this_thread::get_id() == main_thread_) {
+        Rcpp::checkUserInterrupt();
+        client_->RefreshToken();
+      }
+    }
+    if (ret < 0 || !limit_.Take(&page_)) {
+      page_.clear();
+      RecordStats();
+      return state_.status().ok();
+    }
+    Clock::time_point copy = Clock::now();
+    std::shared_ptr<std::string> batch = std::make_shared<std::string>();
+    batch->swap(*page_.Flatten());
+    page_.clear();
+    arrow_ipc::export_record_batch(batch, fields_, out);
+    copy_seconds_ += seconds_since(copy);
+    return true;
+  }
+
+  const char* Error() {
+    grpc::Status status = state_.status();
+    if (!status.ok()) {
+      error_ = "grpc method ReadRows error -> " + status.error_message();
+    }
+    return error_.empty() ? NULL : error_.c_str();
+  }
+
+  void SetError(const std::string& error) { error_ = error; }
+
+private:
+  // Hand the counters over to the client once, at the end of the stream
+  void RecordStats() {
+    if (recorded_) {
+      return;
+    }
+    ReadMetrics stats = state_.Stats();
+    stats.session_seconds = session_seconds_;
+    stats.copy_seconds = copy_seconds_;
+    client_->SetStats(stats);
+    recorded_ = true;
+  }
+
+  Rcpp::XPtr<BigQueryReadClient> client_;
+  ReadSession read_session_;
+  double session_seconds_;
+  double copy_seconds_ = 0;
+  bool recorded_ = false;
+  std::thread::id main_thread_;
+  std::vector<arrow_ipc::Field> fields_;
+  ReadState state_;
+  Payload page_;
+  RowLimit limit_;
+  std::string error_;
+  // Declared last so workers are joined before the state they use is freed
+  std::unique_ptr<ReadPool> pool_;
+};
+
+// Arrow C stream callbacks, owning the batch reader. Errors are returned
+// as codes for the consumer to report.
+int batch_stream_get_schema(ArrowArrayStream* stream, ArrowSchema* out) {
+  BatchReader* reader = static_cast<BatchReader*>(stream->private_data);
+  try {
+    reader->Schema(out);
+    return 0;
+  } catch (const std::exception& e) {
+    reader->SetError(e.what());
+    return EINVAL;
+  }
+}
+
+int batch_stream_get_next(ArrowArrayStream* stream, ArrowArray* out) {
+  BatchReader* reader = static_cast<BatchReader*>(stream->private_data);
+  try {
+    return reader->Next(out) ? 0 : EIO;
+  } catch (const Rcpp::internal::InterruptedException&) {
+    reader->SetError("Interrupted.");
+    return EINTR;
+  } catch (const std::exception& e) {
+    reader->SetError(e.what());
+    return EINVAL;
+  }
+}
+
+const char* batch_stream_get_last_error(ArrowArrayStream* stream) {
+  return static_cast<BatchReader*>(stream->private_data)->Error();
+}
+
+void batch_stream_release(ArrowArrayStream* stream) {
+  delete static_cast<BatchReader*>(stream->private_data);
+  stream->private_data = NULL;
+  stream->release = NULL;
+}
+
+// -- Chunk collector ----------------------------------------------------------
+
+// Copies pages taken in arrival order to R as IPC stream chunks of about
+// flush_bytes, remembering where each batch went, and finally lists the
+// batches to keep in output order. Only used on the main thread.
+class ChunkCollector {
+public:
+  ChunkCollector(const std::string& schema, std::size_t flush_bytes)
+    : schema_(schema), flush_bytes_(std::min(chunk_bytes, flush_bytes)) {}
+
+  void Add(Payload* page, const PageInfo& info) {
+    std::size_t offset = pending_.empty() ? schema_.size() :
+      batches_.back().offset + batches_.back().size;
+    batches_.push_back({chunks_.size(), offset, page->size(), info});
+    pending_bytes_ += page->size();
+    pending_.emplace_back();
+    pending_.back().swap(*page);
+    if (pending_bytes_ >= flush_bytes_) {
+      Flush();
+    }
+  }
+
+  // IPC streams with batches in arrival order. Attribute order lists the
+  // batches to keep in output order, up to n rows with the batch crossing n
+  // sliced in place, and attribute fields the fields of the schema.
+  Rcpp::List Finish(std::int64_t n, bool ordered,
+                    const std::vector<int>& buffers) {
+    if (!pending_.empty() || chunks_.empty()) {
+      Flush();
+    }
+    std::vector<PageInfo> arrival;
+    for (const Batch& batch : batches_) {
+      arrival.push_back(batch.info);
+    }
+    std::vector<arrow_ipc::Field> fields = arrow_ipc::parse_schema(schema_);
+    std::vector<int> order;
+    // Rows of the batches kept, past n when a batch could not be sliced
+    std::int64_t rows = 0, kept = 0;
+    for (std::size_t i : page_sequence(arrival, ordered, buffers)) {
+      if (n > 0 && rows >= n) {
+        break;
+      }
+      const Batch& batch = batches_[i];
+      std::int64_t batch_rows = batch.info.rows;
+      if (n > 0 && rows + batch.info.rows > n) {
+        std::uint8_t* data = chunks_[batch.chunk].begin() + batch.offset;
+        std::string page(reinterpret_cast<const char*>(data), batch.size);
+        try {
+          if (arrow_ipc::slice_record_batch(&page, fields, n - rows)) {
+            std::memcpy(data, page.data(), batch.size);
+            batch_rows = n - rows;
+          }
+        } catch (const std::exception& e) {
+          // Left for nanoarrow to report
+        }
+      }
+      rows += batch.info.rows;
+      kept += batch_rows;
+      order.push_back(int(i) + 1);
+    }
+
+    Rcpp::List out(chunks_.begin(), chunks_.end());
+    out.attr("order") = Rcpp::wrap(order);
+    out.attr("rows") = double(kept);
+    out.attr("fields") = bq_fields(fields);
+    order_.swap(order);
+    return out;
+  }
+
+  // Write the batches kept by Finish to an Arrow IPC file, in output order
+  void Save(const std::string& path) {
+    arrow_ipc::FileWriter file(path, schema_, 1024 * 1024);
+    std::string page;
+    for (int i : order_) {
+      const Batch& batch = batches_[i - 1];
+      page.assign(reinterpret_cast<const char*>(
+        chunks_[batch.chunk].begin() + batch.offset), batch.size);
+      file.WriteBatch(page);
+    }
+    file.Close();
+  }
+
+  double copy_seconds() const { return copy_seconds_; }
+  std::size_t batches() const { return batches_.size(); }
+
+private:
+  // Where a batch went: its chunk and its position in the chunk
+  struct Batch {
+    std::size_t chunk;
+    std::size_t offset;
+    std::size_t size;
+    PageInfo info;
+  };
+
+  void Flush() {
+    Clock::time_point copy = Clock::now();
+    chunks_.push_back(ipc_chunk(schema_, &pending_));
+    pending_bytes_ = 0;
+    copy_seconds_ += seconds_since(copy);
+  }
+
+  const std::string& schema_;
+  std::size_t flush_bytes_;
+  std::vector<Rcpp::RawVector> chunks_;
+  std::vector<Batch> batches_;
+  std::vector<int> order_;
+  std::vector<Payload> pending_;
+  std::size_t pending_bytes_ = 0;
+  double copy_seconds_ = 0;
+};
+
+// -- Result cache -------------------------------------------------------------
+
+// Reads pinned to a snapshot_time are stored as Arrow IPC files named after
+// a hash of the table, the snapshot and the read options, in a directory
+// shared by R processes. The key is known before the read session, so hits
+// create no session. Entries are written to a temporary file first and
+// renamed, so they are never seen half written, and served by mapping them
+// into an ALTREP raw vector. Eviction is left to R.
+
+// FNV-1a hash of a string, from the given offset basis
+inline std::uint64_t fnv1a(const std::string& data, std::uint64_t hash) {
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Name of the cache entry of a read, empty when the read is not pinned to
+// a snapshot_time. Sessions without one read the table as of their
+// creation, which differs from one session to the next.
+std::string cache_key(const std::string& table,
+                      const std::vector<std::string>& selected_fields,
+                      const std::string& row_restriction,
+                      double sample_percentage,
+                      std::int64_t timestamp_seconds,
+                      std::int32_t timestamp_nanos) {
+  if (timestamp_seconds <= 0 && timestamp_nanos <= 0) {
+    return "";
+  }
+  std::string key = "bqs1\n" + table + "\n" +
+    std::to_string(timestamp_seconds) + "." + std::to_string(timestamp_nanos) +
+    "\n" + row_restriction + "\n";
+  char sample[32];
+  std::snprintf(sample, sizeof(sample), "%.17g\n",
+                sample_percentage < 0 ? -1 : sample_percentage);
+  key += sample;
+  for (const std::string& field : selected_fields) {
+    key += field + "\n";
+  }
+  char name[33];
+  std::snprintf(name, sizeof(name), "%016llx%016llx",
+                (unsigned long long)(fnv1a(key, 14695981039346656037ULL)),
+                (unsigned long long)(fnv1a(key, 0x6c62272e07bb0142ULL)));
+  return name;
+}
+
+// A cache entry mapped copy-on-write, so writes through the vector never
+// reach the file. Exposes the IPC stream inside the file: the schema and
+// record batches between the magic and the footer.
+class MappedEntry {
+public:
+  explicit MappedEntry(const std::string& path) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ,
+                              FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+      return;
+    }
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0) {
+      HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_WRITECOPY, 0, 0,
+                                          NULL);
+      if (mapping != NULL) {
+        data_ = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+        size_ = std::size_t(size.QuadPart);
+        CloseHandle(mapping);
+      }
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                        fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = data;
+        size_ = std::size_t(st.st_size);
+      }
+    }
+    close(fd);
+#endif
+    Locate();
+  }
+  ~MappedEntry() {
+    if (data_ == NULL) {
+      return;
+    }
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+#else
+    munmap(data_, size_);
+#endif
+  }
+
+  bool ok() const { return stream_size_ > 0; }
+  std::uint8_t* stream() const {
+    return static_cast<std::uint8_t*>(data_) + 8;
+  }
+  std::size_t stream_size() const { return stream_size_; }
+
+  // The schema message the stream starts with
+  std::string Schema() const {
+    const std::uint8_t* data = stream();
+    if (stream_size_ < 8 ||
+        arrow_ipc::read<std::uint32_t>(data) != arrow_ipc::continuation) {
+      arrow_ipc::invalid();
+    }
+    std::int32_t length = arrow_ipc::read<std::int32_t>(data + 4);
+    if (length <= 0 || std::size_t(length) > stream_size_ - 8) {
+      arrow_ipc::invalid();
+    }
+    return std::string(reinterpret_cast<const char*>(data),
+                       8 + std::size_t(length));
+  }
+
+private:
+  // Check the magic at both ends and find the footer
+  void Locate() {
+    if (data_ == NULL || size_ < 8 + 10) {
+      return;
+    }
+    const std::uint8_t* data = static_cast<const std::uint8_t*>(data_);
+    if (std::memcmp(data, "ARROW1", 6) != 0 ||
+        std::memcmp(data + size_ - 6, "ARROW1", 6) != 0) {
+      return;
+    }
+    std::int32_t footer;
+    std::memcpy(&footer, data + size_ - 10, 4);
+    if (footer < 0 || std::size_t(footer) + 10 + 8 >= size_) {
+      return;
+    }
+    stream_size_ = size_ - 10 - std::size_t(footer) - 8;
+  }
+
+  void* data_ = NULL;
+  std::size_t size_ = 0;
+  std::size_t stream_size_ = 0;
+};
+
+R_altrep_class_t mapped_raw_class;
+
+MappedEntry* mapped_entry(SEXP x) {
+  return static_cast<MappedEntry*>(R_ExternalPtrAddr(R_altrep_data1(x)));
+}
+
+R_xlen_t mapped_raw_length(SEXP x) {
+  return R_xlen_t(mapped_entry(x)->stream_size());
+}
+
+void* mapped_raw_dataptr(SEXP x, Rboolean writeable) {
+  return mapped_entry(x)->stream();
+}
+
+const void* mapped_raw_dataptr_or_null(SEXP x) {
+  return mapped_entry(x)->stream();
+}
+
+void mapped_entry_finalize(SEXP ptr) {
+  delete static_cast<MappedEntry*>(R_ExternalPtrAddr(ptr));
+  R_ClearExternalPtr(ptr);
+}
+
+// [[Rcpp::init]]
+void bqs_init_cache(DllInfo* dll) {
+  mapped_raw_class = R_make_altraw_class("bqs_mapped_raw", "bigrquerystorage",
+                                         dll);
+  R_set_altrep_Length_method(mapped_raw_class, mapped_raw_length);
+  R_set_altvec_Dataptr_method(mapped_raw_class, mapped_raw_dataptr);
+  R_set_altvec_Dataptr_or_null_method(mapped_raw_class,
+                                      mapped_raw_dataptr_or_null);
+}
+
+// The IPC stream of a cache entry as a raw vector backed by the mapped
+// file, or NULL when there is no valid entry at path. Sets fields to the
+// fields of its schema.
+SEXP cache_lookup(const std::string& path,
+                  std::vector<arrow_ipc::Field>* fields) {
+  std::unique_ptr<MappedEntry> entry(new MappedEntry(path));
+  if (!entry->ok()) {
+    return R_NilValue;
+  }
+  try {
+    *fields = arrow_ipc::parse_schema(entry->Schema());
+  } catch (const std::exception& e) {
+    return R_NilValue;
+  }
+  Rcpp::RObject ptr(R_MakeExternalPtr(entry.release(), R_NilValue,
+                                      R_NilValue));
+  R_RegisterCFinalizerEx(ptr, mapped_entry_finalize, TRUE);
+  return R_new_altrep(mapped_raw_class, ptr, R_NilValue);
+}
+
+// Store a finished read at path. Failing to write the cache only warns.
+void cache_store(ChunkCollector* collector, const std::string& path) {
+#ifdef _WIN32
+  std::string temp = path + "." + std::to_string(_getpid()) + ".tmp";
+#else
+  std::string temp = path + "." + std::to_string(getpid()) + ".tmp";
+#endif
+  try {
+    collector->Save(temp);
+  } catch (const std::exception& e) {
+    std::remove(temp.c_str());
+    Rcpp::warning("Could not write the cache entry: %s", e.what());
+    return;
+  }
+  if (std::rename(temp.c_str(), path.c_str()) != 0) {
+    std::remove(temp.c_str());
+  }
+}
+
+// -- Background download ------------------------------------------------------
+
+// Runs a whole download on a background thread, from the read session to the
+// last page, so the R main thread stays free. Pages are kept in C++ until
+// the main thread takes the value, R is only touched from the main thread,
+// which also renews the access token each time it polls.
+class AsyncDownload {
+public:
+  AsyncDownload(SEXP client, const SessionRequest& request, std::int64_t n,
+                int threads, bool ordered)
+    : client_(client), raw_client_(client_.get()), request_(request),
+      n_(n), threads_(threads), ordered_(ordered) {
+    thread_ = std::thread([this]() { Run(); });
+  }
+  ~AsyncDownload() {
+    Cancel();
+    thread_.join();
+  }
+
+  // Cancel the session creation or the pending reads
+  void Cancel() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    cancelled_ = true;
+    if (context_ != NULL) {
+      context_->TryCancel();
+    }
+    if (state_ != NULL) {
+      state_->Cancel();
+    }
+  }
+
+  bool Done() {
+    client_->RefreshToken();
+    std::lock_guard<std::mutex> lock(mutex_);
+    return done_;
+  }
+
+  // Fraction of the download read so far, between 0 and 1
+  double Progress() {
+    client_->RefreshToken();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (done_) {
+      return error_.empty() ? 1 : progress_;
+    }
+    if (state_ == NULL) {
+      return 0;
+    }
+    progress_ = state_->Progress();
+    return progress_;
+  }
+
+  // Wait for the download, checking for user interrupts, and hand the pages
+  // over to R as IPC stream chunks. The value can only be taken once.
+  Rcpp::List Value() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!done_) {
+      cv_.wait_for(lock, std::chrono::milliseconds(100));
+      lock.unlock();
+      Rcpp::checkUserInterrupt();
+      client_->RefreshToken();
+      lock.lock();
+    }
+    lock.unlock();
+    if (taken_) {
+      Rcpp::stop("The value of this download was already taken.");
+    }
+    taken_ = true;
+    if (!stats_.session.empty()) {
+      client_->SetStats(stats_);
+    }
+    if (!error_.empty()) {
+      Rcpp::stop(error_.c_str());
+    }
+
+    ChunkCollector collector(session_.arrow_schema().serialized_schema(),
+                             chunk_bytes);
+    for (std::size_t i = 0; i < pages_.size(); i++) {
+      collector.Add(&pages_[i], infos_[i]);
+    }
+    std::vector<Payload>().swap(pages_);
+    Rcpp::List chunks = collector.Finish(n_, ordered_, order_);
+    stats_.copy_seconds = collector.copy_seconds();
+    client_->SetStats(stats_);
+    return chunks;
+  }
+
+private:
+  void Run() {
+    grpc::ClientContext context;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      context_ = &context;
+      if (cancelled_) {
+        context.TryCancel();
+      }
+    }
+    double session_seconds = 0;
+    grpc::Status status = open_read_session(
+      raw_client_, request_, &context, &threads_, &session_,
+      &session_seconds);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      context_ = NULL;
+    }
+    if (!status.ok()) {
+      Finish(ReadMetrics(),
+             "gRPC method CreateReadSession error -> " + status.error_message());
+      return;
+    }
+
+    ReadState state(session_, n_, request_.buffer_compression,
+                    std::numeric_limits<std::size_t>::max());
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      state_ = &state;
+      if (cancelled_) {
+        state.Cancel();
+      }
+    }
+    {
+      ReadPool pool(raw_client_, session_, &state, threads_);
+      Payload page;
+      PageInfo info;
+      int ret;
+      while ((ret = state.Pop(&page, std::chrono::milliseconds(100),
+                              &info)) >= 0) {
+        if (ret > 0) {
+          pages_.emplace_back();
+          pages_.back().swap(page);
+          infos_.push_back(info);
+        }
+      }
+    }
+    order_ = state.StreamOrder();
+    ReadMetrics stats = state.Stats();
+    stats.session_seconds = session_seconds;
+    status = state.status();
+    Finish(stats, status.ok() ? "" :
+           "grpc method ReadRows error -> " + status.error_message());
+  }
+
+  // Publish the outcome of the download, before the read state goes away
+  void Finish(const ReadMetrics& stats, const std::string& error) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    state_ = NULL;
+    stats_ = stats;
+    error_ = cancelled_ ? "The download was cancelled." : error;
+    done_ = true;
+    cv_.notify_all();
+  }
+
+  Rcpp::XPtr<BigQueryReadClient> client_;
+  BigQueryReadClient* raw_client_;
+  SessionRequest request_;
+  std::int64_t n_;
+  int threads_;
+  bool ordered_;
+  ReadSession session_;
+  std::vector<Payload> pages_;
+  std::vector<PageInfo> infos_;
+  std::vector<int> order_;
+  ReadMetrics stats_;
+  std::string error_;
+  double progress_ = 0;
+  bool cancelled_ = false;
+  bool done_ = false;
+  bool taken_ = false;
+  grpc::ClientContext* context_ = NULL;
+  ReadState* state_ = NULL;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::thread thread_;
+};
+
+// -- Client functions ---------------------------------------------------------
+
+// Bytes of queued pages before streams park, Inf for no limit
+std::size_t memory_budget(double bytes) {
+  if (!(bytes < double(std::numeric_limits<std::size_t>::max()))) {
+    return std::numeric_limits<std::size_t>::max();
+  }
+  return std::max<std::size_t>(std::size_t(bytes), 1);
+}
+
+// Compression codec from its R name
+codec::Codec bqs_codec(const std::string& name) {
+  codec::Codec requested = codec::none;
+  if (name == "lz4") {
+    requested = codec::lz4_frame;
+  } else if (name == "zstd") {
+    requested = codec::zstd;
+  }
+  if (!codec::available(requested)) {
+    std::string err;
+    err += "Compression `";
+    err += name;
+    err += "` is not available, bigrquerystorage was built without lib";
+    err += name;
+    err += ".";
+    Rcpp::stop(err.c_str());
+  }
+  return requested;
+}
+
+// Same from the main thread, failing with an R error
+ReadSession bqs_read_session(BigQueryReadClient* client,
+                             const std::string& project,
+                             const std::string& dataset,
+                             const std::string& table,
+                             const std::string& parent,
+                             const std::vector<std::string>& selected_fields,
+                             const std::string& row_restriction,
+                             std::double_t sample_percentage,
+                             std::int64_t timestamp_seconds,
+                             std::int32_t timestamp_nanos,
+                             int* threads,
+                             std::int32_t max_stream_count,
+                             std::int32_t preferred_min_stream_count,
+                             codec::Codec buffer_compression,
+                             codec::Codec response_compression,
+                             double* seconds) {
+  SessionRequest request;
+  request.project = project;
+  request.dataset = dataset;
+  request.table = table;
+  request.parent = parent;
+  request.selected_fields = selected_fields;
+  request.row_restriction = row_restriction;
+  request.sample_percentage = sample_percentage;
+  request.timestamp_seconds = timestamp_seconds;
+  request.timestamp_nanos = timestamp_nanos;
+  request.max_stream_count = max_stream_count;
+  request.preferred_min_stream_count = preferred_min_stream_count;
+  request.buffer_compression = buffer_compression;
+  request.response_compression = response_compression;
+
+  grpc::ClientContext context;
+  ReadSession read_session;
+  grpc::Status status = open_read_session(client, request, &context, threads,
+                                          &read_session, seconds);
+  if (!status.ok()) {
+    std::string err;
+    err += "gRPC method CreateReadSession error -> ";
+    err += status.error_message();
+    Rcpp::stop(err.c_str());
+  }
+  return read_session;
+}
+
+// HTTP/2 and gRPC channel settings from bqs_transport(). Negative values
+// keep the gRPC defaults.
+struct Transport {
+  int stream_window = -1;
+  int bdp_probe = -1;
+  int keepalive_ms = -1;
+  int max_message_size = 104857600;
+  double memory_quota = -1;
+};
+
+// Transport settings from their R list, NULL for the defaults
+Transport bqs_transport_settings(SEXP settings) {
+  Transport transport;
+  if (Rf_isNull(settings)) {
+    return transport;
+  }
+  Rcpp::List list(settings);
+  auto value = [&list](const char* name, double missing) {
+    if (!list.containsElementNamed(name)) {
+      return missing;
+    }
+    double v = Rcpp::as<double>(list[name]);
+    return std::isnan(v) ? missing : v;
+  };
+  transport.stream_window = int(value("stream_window", -1));
+  transport.bdp_probe = int(value("bdp_probe", -1));
+  transport.keepalive_ms = int(value("keepalive_ms", -1));
+  transport.max_message_size = int(value("max_message_size",
+                                         transport.max_message_size));
+  transport.memory_quota = value("memory_quota", -1);
+  return transport;
+}
+
+SEXP bqs_read_client(std::shared_ptr<grpc::ChannelCredentials> cred,
+                     std::string client_info,
+                     std::string service_configuration,
+                     std::string target,
+                     int channels,
+                     const Transport& transport,
+                     std::shared_ptr<TokenStore> token = nullptr) {
+
+  // A single memory quota bounds the buffers, hence the HTTP/2 connection
+  // windows, of all channels
+  grpc::ResourceQuota quota("bigrquerystorage");
+  if (transport.memory_quota > 0) {
+    quota.Resize(std::size_t(transport.memory_quota));
+  }
+
+  // Each channel gets its own subchannel, hence its own HTTP/2 connection,
+  // with a local subchannel pool and a distinct channel argument. Channels
+  // only connect once a call is made on them.
+  std::vector<std::shared_ptr<grpc::Channel> > pool;
+  for (int i = 0; i < std::max(channels, 1); i++) {
+    grpc::ChannelArguments channel_arguments;
+    channel_arguments.SetMaxReceiveMessageSize(transport.max_message_size);
+    channel_arguments.SetServiceConfigJSON(service_configuration);
+    channel_arguments.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    channel_arguments.SetInt("bigrquerystorage.channel_index", i);
+    if (transport.memory_quota > 0) {
+      channel_arguments.SetResourceQuota(quota);
+    }
+    if (transport.stream_window > 0) {
+      channel_arguments.SetInt(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES,
+                               transport.stream_window);
+    }
+    if (transport.bdp_probe >= 0) {
+      channel_arguments.SetInt(GRPC_ARG_HTTP2_BDP_PROBE, transport.bdp_probe);
+    }
+    // Pings keep connections of streams parked by memory_limit alive through
+    // idle timeouts of proxies and load balancers
+    if (transport.keepalive_ms > 0) {
+      channel_arguments.SetInt(GRPC_ARG_KEEPALIVE_TIME_MS,
+                               transport.keepalive_ms);
+      channel_arguments.SetInt(GRPC_ARG_KEEPALIVE_TIMEOUT_MS,
+                               std::min(transport.keepalive_ms, 20000));
+      channel_arguments.SetInt(GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
+    }
+    pool.push_back(grpc::CreateCustomChannel(target, cred, channel_arguments));
+  }
+
+  BigQueryReadClient *client = new BigQueryReadClient(pool);
+
+  client->SetClientInfo(client_info);
+  client->SetTokenStore(token);
+
+  Rcpp::XPtr<BigQueryReadClient> ptr(client, true);
+
+  return ptr;
+
+}
+
+// [[Rcpp::export(rng=false)]]
+SEXP bqs_client(std::string client_info,
+                std::string service_configuration,
+                std::string refresh_token = "",
+                std::string access_token = "",
+                std::string root_certificate = "",
+                std::string target = "bigquerystorage.googleapis.com:443",
+                int channels = 4,
+                SEXP transport = R_NilValue) {
+
+  // Refresh token and default credentials renew their access tokens on their
+  // own. A bare access token is renewed from R with bqs_client_token.
+  std::shared_ptr<grpc::ChannelCredentials> cred;
+  std::shared_ptr<TokenStore> token;
+  if (!refresh_token.empty()) {
+    cred = bqs_refresh_token_credentials(refresh_token,
+                                         readfile(root_certificate));
+  }
+  if (!cred && !access_token.empty()) {
+    token = std::make_shared<TokenStore>(access_token);
+    cred = bqs_access_token_credentials(token, readfile(root_certificate));
+  }
+  if (!cred) {
+    cred = bqs_google_credentials();
+  }
+  if (!cred) {
+    Rcpp::stop("Could not create credentials.");
+  }
+
+  return bqs_read_client(cred, client_info,
+                         readfile(service_configuration), target, channels,
+                         bqs_transport_settings(transport), token);
+
+}
+
+// Client of a local server without TLS nor credentials, such as the one
+// started by bqs_mock_server
+// [[Rcpp::export(rng=false)]]
+SEXP bqs_insecure_client(std::string client_info,
+                         std::string service_configuration,
+                         std::string target,
+                         int channels = 4,
+                         SEXP transport = R_NilValue) {
+  return bqs_read_client(grpc::InsecureChannelCredentials(), client_info,
+                         readfile(service_configuration), target, channels,
+                         bqs_transport_settings(transport));
+}
+
+// Hand the client a new access token, valid for expires_in seconds (0 when
+// unknown). refresh is a function called from the main thread during reads
+// to renew it, returning a list of access_token and expires_in.
+// [[Rcpp::export(rng=false)]]
+bool bqs_client_token(SEXP client, std::string access_token,
+                      double expires_in = 0, SEXP refresh = R_NilValue) {
+  Rcpp::XPtr<BigQueryReadClient> client_ptr(client);
+  return client_ptr->SetToken(access_token, expires_in, refresh);
+}
+
+// Counters of the last read of a client, NULL before the first one. Times
+// are in seconds, NA for streams that never received a page or finished.
+// [[Rcpp::export(rng=false)]]
+SEXP bqs_client_stats(SEXP client) {
+  Rcpp::XPtr<BigQueryReadClient> client_ptr(client);
+  const ReadMetrics& stats = client_ptr->stats();
+  if (stats.session.empty() && stats.cache.empty()) {
+    return R_NilValue;
+  }
+
+  std::size_t n = stats.streams.size();
+  Rcpp::CharacterVector name(n);
+  Rcpp::NumericVector rows(n), bytes(n), pages(n), first_page(n),
+    finished(n), stall(n), decode(n);
+  Rcpp::IntegerVector retries(n);
+  std::vector<int> throttle_stream;
+  std::vector<double> throttle_seconds;
+  std::vector<int> throttle_percent;
+  double total_rows = 0, total_bytes = 0, total_pages = 0, total_stall = 0,
+    total_decode = 0, first = -1;
+  int total_retries = 0;
+  for (std::size_t i = 0; i < n; i++) {
+    const StreamMetrics& stream = stats.streams[i];
+    name[i] = stream.name;
+    rows[i] = double(stream.rows);
+    bytes[i] = double(stream.bytes);
+    pages[i] = double(stream.pages);
+    first_page[i] = stream.first_page < 0 ? NA_REAL : stream.first_page;
+    finished[i] = stream.finished < 0 ? NA_REAL : stream.finished;
+    stall[i] = stream.stall;
+    decode[i] = stream.decode;
+    retries[i] = stream.retries;
+    for (const std::pair<double, int>& change : stream.throttle) {
+      throttle_stream.push_back(int(i) + 1);
+      throttle_seconds.push_back(change.first);
+      throttle_percent.push_back(change.second);
+    }
+    total_rows += double(stream.rows);
+    total_bytes += double(stream.bytes);
+    total_pages += double(stream.pages);
+    total_stall += stream.stall;
+    total_decode += stream.decode;
+    total_retries += stream.retries;
+    if (stream.first_page >= 0 &&
+        (first < 0 || stream.first_page < first)) {
+      first = stream.first_page;
+    }
+  }
+
+  return Rcpp::List::create(
+    Rcpp::Named("session") = stats.session,
+    Rcpp::Named("session_seconds") = stats.session_seconds,
+    Rcpp::Named("first_page_seconds") = first < 0 ? NA_REAL : first,
+    Rcpp::Named("read_seconds") = stats.read_seconds,
+    Rcpp::Named("copy_seconds") = stats.copy_seconds,
+    Rcpp::Named("decode_seconds") = total_decode,
+    // Measured in R, filled in by name by bqs_last_stats()
+    Rcpp::Named("convert_seconds") = NA_REAL,
+    Rcpp::Named("stall_seconds") = total_stall,
+    Rcpp::Named("rows") = total_rows,
+    Rcpp::Named("bytes") = total_bytes,
+    Rcpp::Named("pages") = total_pages,
+    Rcpp::Named("retries") = total_retries,
+    Rcpp::Named("splits") = stats.splits,
+    Rcpp::Named("memory_limit") = stats.memory_limit,
+    Rcpp::Named("peak_queued_bytes") = double(stats.peak_queued),
+    Rcpp::Named("cache") = stats.cache.empty() ?
+      Rcpp::CharacterVector::create(NA_STRING) :
+      Rcpp::CharacterVector::create(stats.cache),
+    Rcpp::Named("streams") = Rcpp::DataFrame::create(
+      Rcpp::Named("stream") = name,
+      Rcpp::Named("rows") = rows,
+      Rcpp::Named("bytes") = bytes,
+      Rcpp::Named("pages") = pages,
+      Rcpp::Named("first_page_seconds") = first_page,
+      Rcpp::Named("finished_seconds") = finished,
+      Rcpp::Named("stall_seconds") = stall,
+      Rcpp::Named("decode_seconds") = decode,
+      Rcpp::Named("retries") = retries,
+      Rcpp::Named("stringsAsFactors") = false),
+    Rcpp::Named("throttle") = Rcpp::DataFrame::create(
+      Rcpp::Named("stream") = throttle_stream,
+      Rcpp::Named("seconds") = throttle_seconds,
+      Rcpp::Named("throttle_percent") = throttle_percent));
+}
+
+// [[Rcpp::export(rng=false)]]
+SEXP bqs_ipc_stream(SEXP client,
+                    std::string project,
+                    std::string dataset,
+                    std::string table,
+                    std::string parent,
+                    std::int64_t n,
+                    std::vector<std::string> selected_fields,
+                    std::string row_restriction = "",
+                    std::double_t sample_percentage = -1,
+                    std::int64_t timestamp_seconds = 0,
+                    std::int32_t timestamp_nanos = 0,
+                    bool quiet = false,
+                    int threads = 0,
+                    bool ordered = true,
+                    std::int32_t max_stream_count = 0,
+                    std::int32_t preferred_min_stream_count = 0,
+                    std::string compression = "none",
+                    std::string response_compression = "none",
+                    std::double_t memory_limit = 134217728,
+                    std::string cache_dir = "") {
+
+  Rcpp::XPtr<BigQueryReadClient> client_ptr(client);
+
+  // Whole reads pinned to a snapshot_time go through the cache, attribute
+  // cache tells R the entry to keep. Entries hold batches in stream order,
+  // so reads in arrival order are left out.
+  std::string cache_path;
+  if (!cache_dir.empty() && n <= 0 && ordered) {
+    std::string key = cache_key(
+      project + "." + dataset + "." + table, selected_fields,
+      row_restriction, sample_percentage, timestamp_seconds, timestamp_nanos);
+    if (!key.empty()) {
+      cache_path = cache_dir + "/" + key + ".arrows";
+    }
+  }
+  if (!cache_path.empty()) {
+    std::vector<arrow_ipc::Field> fields;
+    Rcpp::RObject hit(cache_lookup(cache_path, &fields));
+    if (hit != R_NilValue) {
+      ReadMetrics stats;
+      stats.cache = "hit";
+      client_ptr->SetStats(stats);
+      Rcpp::List chunks = Rcpp::List::create(hit);
+      chunks.attr("fields") = bq_fields(fields);
+      chunks.attr("cache") = cache_path;
+      if (!quiet) {
+        REprintf("Read from the cache.\n");
+      }
+      return chunks;
+    }
+  }
+
+  codec::Codec buffer_compression = bqs_codec(compression);
+  double session_seconds;
+  ReadSession read_session = bqs_read_session(
+    client_ptr.get(), project, dataset, table, parent, selected_fields,
+    row_restriction, sample_percentage, timestamp_seconds, timestamp_nanos,
+    &threads, max_stream_count, preferred_min_stream_count,
+    buffer_compression, bqs_codec(response_compression), &session_seconds);
+
+  int streams = read_session.streams_size();
+  std::size_t budget = memory_budget(memory_limit);
+  ReadState state(read_session, n, buffer_compression, budget);
+  ChunkCollector collector(read_session.arrow_schema().serialized_schema(),
+                           budget);
+  ProgressReporter progress(&state, quiet);
+
+  // Copy pages to R while streams are read, polling the shared state from
+  // the main thread. Streams park while memory_limit bytes are queued.
+  {
+    ReadPool pool(client_ptr.get(), read_session, &state, threads);
+    Payload page;
+    PageInfo info;
+    int ret;
+    while ((ret = state.Pop(&page, std::chrono::milliseconds(100),
+                            &info)) >= 0) {
+      if (ret > 0) {
+        collector.Add(&page, info);
+      }
+      if (progress.Sample()) {
+        Rcpp::checkUserInterrupt();
+        client_ptr->RefreshToken();
+      }
+    }
+  }
+
+  ReadMetrics stats = state.Stats();
+  stats.session_seconds = session_seconds;
+  stats.copy_seconds = collector.copy_seconds();
+  client_ptr->SetStats(stats);
+
+  grpc::Status status = state.status();
+  if (!status.ok()) {
+    std::string err;
+    err += "grpc method ReadRows error -> ";
+    err += status.error_message();
+    Rcpp::stop(err.c_str());
+  }
+
+  if (streams > 0) {
+    progress.Done();
+  }
+
+  // Batches in stream order or in arrival order, up to n rows
+  Rcpp::List chunks = collector.Finish(n, ordered, state.StreamOrder());
+  if (!cache_path.empty()) {
+    cache_store(&collector, cache_path);
+    chunks.attr("cache") = cache_path;
+    stats.cache = "miss";
+  }
+  stats.copy_seconds = collector.copy_seconds();
+  client_ptr->SetStats(stats);
+
+  if (!quiet) {
+    REprintf("Streamed %ld rows in %ld messages.\n",
+             long(state.rows()), state.pages());
+    if (state.resumed() > 0) {
+      REprintf("Resumed interrupted streams %d times.\n", state.resumed());
+    }
+    if (state.splits() > 0) {
+      REprintf("Split %d slow streams.\n", state.splits());
+    }
+  }
+
+  return chunks;
+}
+
+// Download several tables at once. Read sessions are created concurrently
+// and the streams of all sessions are read by one worker pool, sharing
+// memory_limit. Returns the IPC stream chunks of each table as
+// bqs_ipc_stream, with attribute batches counting their batches.
+// [[Rcpp::export(rng=false)]]
+SEXP bqs_ipc_tables(SEXP client,
+                    std::vector<std::string> projects,
+                    std::vector<std::string> datasets,
+                    std::vector<std::string> tables,
+                    std::string parent,
+                    std::int64_t n,
+                    std::vector<std::string> selected_fields,
+                    std::string row_restriction = "",
+                    std::double_t sample_percentage = -1,
+                    std::int64_t timestamp_seconds = 0,
+                    std::int32_t timestamp_nanos = 0,
+                    bool quiet = false,
+                    int threads = 0,
+                    bool ordered = true,
+                    std::int32_t max_stream_count = 0,
+                    std::int32_t preferred_min_stream_count = 0,
+                    std::string compression = "none",
+                    std::string response_compression = "none",
+                    std::double_t memory_limit = 134217728) {
+
+  Rcpp::XPtr<BigQueryReadClient> client_ptr(client);
+
+  std::size_t count = tables.size();
+  codec::Codec buffer_compression = bqs_codec(compression);
+  std::vector<SessionRequest> requests(count);
+  for (std::size_t i = 0; i < count; i++) {
+    SessionRequest& request = requests[i];
+    request.project = projects[i];
+    request.dataset = datasets[i];
+    request.table = tables[i];
+    request.parent = parent;
+    request.selected_fields = selected_fields;
+    request.row_restriction = row_restriction;
+    request.sample_percentage = sample_percentage;
+    request.timestamp_seconds = timestamp_seconds;
+    request.timestamp_nanos = timestamp_nanos;
+    request.max_stream_count = max_stream_count;
+    request.preferred_min_stream_count = preferred_min_stream_count;
+    request.buffer_compression = buffer_compression;
+    request.response_compression = bqs_codec(response_compression);
+  }
+
+  SessionBatch sessions(client_ptr.get(), requests, threads);
+  double session_seconds = sessions.Wait();
+
+  // Threads worth starting for each session, up to the requested number
+  if (threads <= 0) {
+    threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  int wanted = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    grpc::Status status = sessions.status(i);
+    if (!status.ok()) {
+      std::string err;
+      err += "gRPC method CreateReadSession error -> ";
+      err += projects[i] + "." + datasets[i] + "." + tables[i] + ": ";
+      err += status.error_message();
+      Rcpp::stop(err.c_str());
+    }
+    wanted += sessions.threads(i);
+  }
+  threads = std::min(threads, wanted);
+
+  std::size_t budget = memory_budget(memory_limit);
+  ReadSignal signal;
+  std::vector<std::unique_ptr<ReadState> > states;
+  std::vector<std::unique_ptr<ChunkCollector> > collectors;
+  std::vector<ReadState*> pool_states;
+  std::vector<const ReadState*> progress_states;
+  int streams = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    const ReadSession& read_session = sessions.session(i);
+    states.emplace_back(new ReadState(read_session, n, buffer_compression,
+                                      budget, &signal));
+    collectors.emplace_back(new ChunkCollector(
+      read_session.arrow_schema().serialized_schema(), budget));
+    pool_states.push_back(states.back().get());
+    progress_states.push_back(states.back().get());
+    streams += read_session.streams_size();
+  }
+  ProgressReporter progress(progress_states, quiet);
+
+  // Drain the queues of all reads whenever any of them has news, and give
+  // up on all of them at the first error
+  {
+    ReadPool pool(client_ptr.get(), pool_states, threads);
+    Payload page;
+    PageInfo info;
+    bool running = true;
+    while (running) {
+      long int seen = signal.count();
+      bool taken = false;
+      running = false;
+      for (std::size_t i = 0; i < count; i++) {
+        int ret;
+        while ((ret = states[i]->Pop(&page, std::chrono::milliseconds(0),
+                                     &info)) > 0) {
+          collectors[i]->Add(&page, info);
+          taken = true;
+        }
+        if (!states[i]->status().ok()) {
+          running = false;
+          break;
+        }
+        running = running || ret == 0;
+      }
+      for (std::size_t i = 0; running && i < count; i++) {
+        states[i]->Resume();
+      }
+      if (running && !taken) {
+        signal.Wait(seen, std::chrono::milliseconds(100));
+      }
+      if (progress.Sample()) {
+        Rcpp::checkUserInterrupt();
+        client_ptr->RefreshToken();
+      }
+    }
+  }
+
+  // Counters of all sessions, as one read
+  ReadMetrics stats;
+  stats.session_seconds = session_seconds;
+  stats.memory_limit = double(budget);
+  stats.peak_queued = signal.peak_queued();
+  grpc::Status status;
+  std::int64_t rows = 0;
+  long int pages = 0;
+  int resumed = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    ReadMetrics one = states[i]->Stats();
+    stats.session += (i > 0 ? "," : "") + one.session;
+    stats.read_seconds = std::max(stats.read_seconds, one.read_seconds);
+    stats.copy_seconds += collectors[i]->copy_seconds();
+    stats.splits += one.splits;
+    stats.streams.insert(stats.streams.end(), one.streams.begin(),
+                         one.streams.end());
+    if (status.ok()) {
+      status = states[i]->status();
+    }
+    rows += states[i]->rows();
+    pages += states[i]->pages();
+    resumed += states[i]->resumed();
+  }
+  client_ptr->SetStats(stats);
+
+  if (!status.ok()) {
+    std::string err;
+    err += "grpc method ReadRows error -> ";
+    err += status.error_message();
+    Rcpp::stop(err.c_str());
+  }
+
+  if (streams > 0) {
+    progress.Done();
+  }
+
+  Rcpp::List out(count);
+  stats.copy_seconds = 0;
+  for (std::size_t i = 0; i < count; i++) {
+    Rcpp::List chunks = collectors[i]->Finish(n, ordered,
+                                              states[i]->StreamOrder());
+    chunks.attr("batches") = double(collectors[i]->batches());
+    out[i] = chunks;
+    stats.copy_seconds += collectors[i]->copy_seconds();
+  }
+  client_ptr->SetStats(stats);
+
+  if (!quiet) {
+    REprintf("Streamed %ld rows in %ld messages from %d tables.\n",
+             long(rows), pages, int(count));
+    if (resumed > 0) {
+      REprintf("Resumed interrupted streams %d times.\n", resumed);
+    }
+    if (stats.splits > 0) {
+      REprintf("Split %d slow streams.\n", stats.splits);
+    }
+  }
+
+  return out;
+}
+
+// [[Rcpp::export(rng=false)]]
+void bqs_batch_stream(SEXP client,
+                      SEXP stream,
+                      std::string project,
+                      std::string dataset,
+                      std::string table,
+                      std::string parent,
+                      std::int64_t n,
+                      std::vector<std::string> selected_fields,
+                      std::string row_restriction = "",
+                      std::double_t sample_percentage = -1,
+                      std::int64_t timestamp_seconds = 0,
+                      std::int32_t timestamp_nanos = 0,
+                      int threads = 0,
+                      std::int32_t max_stream_count = 0,
+                      std::int32_t preferred_min_stream_count = 0,
+                      std::string compression = "none",
+                      std::string response_compression = "none",
+                      std::double_t read_ahead = 134217728) {
+
+  Rcpp::XPtr<BigQueryReadClient> client_ptr(client);
+  ArrowArrayStream* out = static_cast<ArrowArrayStream*>(
+    R_ExternalPtrAddr(stream));
+  if (!Rf_inherits(stream, "nanoarrow_array_stream") || out == NULL ||
+      out->release != NULL) {
+    Rcpp::stop("`stream` must be a newly allocated nanoarrow_array_stream.");
+  }
+
+  codec::Codec buffer_compression = bqs_codec(compression);
+  double session_seconds;
+  ReadSession read_session = bqs_read_session(
+    client_ptr.get(), project, dataset, table, parent, selected_fields,
+    row_restriction, sample_percentage, timestamp_seconds, timestamp_nanos,
+    &threads, max_stream_count, preferred_min_stream_count,
+    buffer_compression, bqs_codec(response_compression), &session_seconds);
+
+  out->private_data = new BatchReader(client, read_session, n,
+                                      buffer_compression, threads,
+                                      memory_budget(read_ahead),
+                                      session_seconds);
+  out->get_schema = batch_stream_get_schema;
+  out->get_next = batch_stream_get_next;
+  out->get_last_error = batch_stream_get_last_error;
+  out->release = batch_stream_release;
+}
+
+// [[Rcpp::export(rng=false)]]
+double bqs_ipc_file(SEXP client,
+                    std::string path,
+                    std::string project,
+                    std::string dataset,
+                    std::string table,
+                    std::string parent,
+                    std::int64_t n,
+                    std::vector<std::string> selected_fields,
+                    std::string row_restriction = "",
+                    std::double_t sample_percentage = -1,
+                    std::int64_t timestamp_seconds = 0,
+                    std::int32_t timestamp_nanos = 0,
+                    bool quiet = false,
+                    int threads = 0,
+                    std::int32_t max_stream_count = 0,
+                    std::int32_t preferred_min_stream_count = 0,
+                    std::string compression = "none",
+                    std::string response_compression = "none",
+                    std::double_t read_ahead = 134217728) {
+
+  Rcpp::XPtr<BigQueryReadClient> client_ptr(client);
+
+  codec::Codec buffer_compression = bqs_codec(compression);
+  double session_seconds;
+  ReadSession read_session = bqs_read_session(
+    client_ptr.get(), project, dataset, table, parent, selected_fields,
+    row_restriction, sample_percentage, timestamp_seconds, timestamp_nanos,
+    &threads, max_stream_count, preferred_min_stream_count,
+    buffer_compression, bqs_codec(response_compression), &session_seconds);
+
+  int streams = read_session.streams_size();
+  ReadState state(read_session, n, buffer_compression,
+                  memory_budget(read_ahead));
+  arrow_ipc::FileWriter file(
+    path, read_session.arrow_schema().serialized_schema(), 1024 * 1024);
+  RowLimit limit(read_session.arrow_schema().serialized_schema(), n);
+  ProgressReporter progress(&state, quiet);
+
+  // Write pages as they arrive, streams park while read_ahead bytes wait
+  double copy_seconds = 0;
+  {
+    ReadPool pool(client_ptr.get(), read_session, &state, threads);
+    std::string page;
+    int ret;
+    while ((ret = state.Pop(&page, std::chrono::milliseconds(100))) >= 0) {
+      Clock::time_point copy = Clock::now();
+      if (ret > 0 && limit.Take(&page)) {
+        file.WriteBatch(page);
+      }
+      copy_seconds += seconds_since(copy);
+      if (progress.Sample()) {
+        Rcpp::checkUserInterrupt();
+        client_ptr->RefreshToken();
+      }
+    }
+  }
+
+  ReadMetrics stats = state.Stats();
+  stats.session_seconds = session_seconds;
+  stats.copy_seconds = copy_seconds;
+  client_ptr->SetStats(stats);
+
+  grpc::Status status = state.status();
+  if (!status.ok()) {
+    std::string err;
+    err += "grpc method ReadRows error -> ";
+    err += status.error_message();
+    Rcpp::stop(err.c_str());
+  }
+
+  file.Close();
+
+  if (streams > 0) {
+    progress.Done();
+  }
+
+  if (!quiet) {
+    REprintf("Wrote %ld rows in %ld messages.\n",
+             long(limit.rows()), long(file.batches()));
+    if (state.resumed() > 0) {
+      REprintf("Resumed interrupted streams %d times.\n", state.resumed());
+    }
+    if (state.splits() > 0) {
+      REprintf("Split %d slow streams.\n", state.splits());
+    }
+  }
+
+  return double(limit.rows());
+}
+
+// Start a download on a background thread, see AsyncDownload
+// [[Rcpp::export(rng=false)]]
+SEXP bqs_download_start(SEXP client,
+                        std::string project,
+                        std::string dataset,
+                        std::string table,
+                        std::string parent,
+                        std::int64_t n,
+                        std::vector<std::string> selected_fields,
+                        std::string row_restriction = "",
+                        std::double_t sample_percentage = -1,
+                        std::int64_t timestamp_seconds = 0,
+                        std::int32_t timestamp_nanos = 0,
+                        int threads = 0,
+                        bool ordered = true,
+                        std::int32_t max_stream_count = 0,
+                        std::int32_t preferred_min_stream_count = 0,
+                        std::string compression = "none",
+                        std::string response_compression = "none") {
+  SessionRequest request;
+  request.project = project;
+  request.dataset = dataset;
+  request.table = table;
+  request.parent = parent;
+  request.selected_fields = selected_fields;
+  request.row_restriction = row_restriction;
+  request.sample_percentage = sample_percentage;
+  request.timestamp_seconds = timestamp_seconds;
+  request.timestamp_nanos = timestamp_nanos;
+  request.max_stream_count = max_stream_count;
+  request.preferred_min_stream_count = preferred_min_stream_count;
+  request.buffer_compression = bqs_codec(compression);
+  request.response_compression = bqs_codec(response_compression);
+  return Rcpp::XPtr<AsyncDownload>(
+    new AsyncDownload(client, request, n, threads, ordered), true);
+}
+
+// [[Rcpp::export(rng=false)]]
+bool bqs_download_done(SEXP download) {
+  Rcpp::XPtr<AsyncDownload> download_ptr(download);
+  return download_ptr->Done();
+}
+
+// [[Rcpp::export(rng=false)]]
+double bqs_download_progress(SEXP download) {
+  Rcpp::XPtr<AsyncDownload> download_ptr(download);
+  return download_ptr->Progress();
+}
+
+// [[Rcpp::export(rng=false)]]
+void bqs_download_cancel(SEXP download) {
+  Rcpp::XPtr<AsyncDownload> download_ptr(download);
+  download_ptr->Cancel();
+}
+
+// [[Rcpp::export(rng=false)]]
+SEXP bqs_download_value(SEXP download) {
+  Rcpp::XPtr<AsyncDownload> download_ptr(download);
+  return download_ptr->Value();
 }
@@ -0,0 +1,411 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <grpcpp/grpcpp.h>
+#include <grpcpp/server_builder.h>
+#include "google/cloud/bigquery/storage/v1/stream.pb.h"
+#include "google/cloud/bigquery/storage/v1/storage.pb.h"
+# pragma GCC diagnostic ignored "-Winconsistent-missing-override"
+#include "google/cloud/bigquery/storage/v1/storage.grpc.pb.h"
+#include <Rcpp.h>
+#include "arrow_ipc.h"
+
+// In-process BigQueryRead server serving synthetic Arrow record batches, to
+// test and benchmark the client without a Google Cloud project.
+
+using google::cloud::bigquery::storage::v1::BigQueryRead;
+using google::cloud::bigquery::storage::v1::CreateReadSessionRequest;
+using google::cloud::bigquery::storage::v1::DataFormat;
+using google::cloud::bigquery::storage::v1::ReadRowsRequest;
+using google::cloud::bigquery::storage::v1::ReadRowsResponse;
+using google::cloud::bigquery::storage::v1::ReadSession;
+using google::cloud::bigquery::storage::v1::SplitReadStreamRequest;
+using google::cloud::bigquery::storage::v1::SplitReadStreamResponse;
+
+// -- Synthetic table ----------------------------------------------------------
+
+// Rows of the mock table are
+//   id INT64 REQUIRED, the row number
+//   value FLOAT64, half the row number
+//   name STRING, "row<id>", NULL every tenth row
+
+// MetadataVersion V5
+const std::int16_t mock_metadata_version = 4;
+
+// Rough size of a row, for the session estimated bytes scanned
+const std::int64_t mock_row_bytes = 28;
+
+std::string mock_schema() {
+  using arrow_ipc::Builder;
+  Builder builder;
+  std::vector<std::size_t> fields;
+  std::size_t message = builder.AddTable({
+    Builder::Value<std::int16_t>(arrow_ipc::message_version,
+                                 mock_metadata_version),
+    Builder::Value<std::uint8_t>(arrow_ipc::message_header_type,
+                                 arrow_ipc::header_schema),
+    Builder::Offset(arrow_ipc::message_header)
+  }, &fields);
+  builder.SetRoot(message);
+  std::size_t header_field = fields[2];
+  std::size_t schema = builder.AddTable({
+    Builder::Offset(arrow_ipc::schema_fields)
+  }, &fields);
+  builder.Patch(header_field, schema);
+
+  struct Column {
+    const char* name;
+    bool nullable;
+    arrow_ipc::Type type;
+  };
+  const std::vector<Column> columns = {
+    {"id", false, arrow_ipc::type_int},
+    {"value", true, arrow_ipc::type_floating_point},
+    {"name", true, arrow_ipc::type_utf8}
+  };
+  std::vector<std::uint32_t> placeholders(columns.size(), 0);
+  std::size_t vector = builder.AddVector(placeholders.data(),
+                                         std::uint32_t(columns.size()), 4);
+  builder.Patch(fields[0], vector);
+
+  for (std::size_t i = 0; i < columns.size(); i++) {
+    std::size_t field = builder.AddTable({
+      Builder::Offset(arrow_ipc::field_name),
+      Builder::Value<std::uint8_t>(arrow_ipc::field_nullable,
+                                   columns[i].nullable),
+      Builder::Value<std::uint8_t>(arrow_ipc::field_type_type,
+                                   columns[i].type),
+      Builder::Offset(arrow_ipc::field_type),
+      Builder::Offset(arrow_ipc::field_children)
+    }, &fields);
+    builder.Patch(vector + 4 + 4 * i, field);
+    std::vector<std::size_t> unused;
+    std::vector<Builder::Field> type;
+    if (columns[i].type == arrow_ipc::type_int) {
+      type.push_back(Builder::Value<std::int32_t>(arrow_ipc::int_bit_width, 64));
+      type.push_back(Builder::Value<std::uint8_t>(arrow_ipc::int_is_signed, 1));
+    } else if (columns[i].type == arrow_ipc::type_floating_point) {
+      // Precision DOUBLE
+      type.push_back(
+        Builder::Value<std::int16_t>(arrow_ipc::floating_point_precision, 2));
+    }
+    builder.Patch(fields[3], builder.AddTable(type, &unused));
+    builder.Patch(fields[0], builder.AddString(columns[i].name));
+    std::uint32_t none = 0;
+    builder.Patch(fields[4], builder.AddVector(&none, 0, 4));
+  }
+
+  std::string out;
+  arrow_ipc::frame_message(builder.buffer(), 0, &out);
+  return out;
+}
+
+// Record batch of rows [first, first + length)
+std::string mock_record_batch(std::int64_t first, std::int64_t length) {
+  using arrow_ipc::Builder;
+  std::vector<std::int32_t> offsets(std::size_t(length) + 1, 0);
+  std::string chars;
+  std::vector<std::uint8_t> validity(std::size_t(length + 7) / 8, 0);
+  std::int64_t nulls = 0;
+  for (std::int64_t i = 0; i < length; i++) {
+    std::int64_t row = first + i;
+    if (row % 10 == 9) {
+      nulls++;
+    } else {
+      validity[i >> 3] |= std::uint8_t(1 << (i & 7));
+      chars += "row";
+      chars += std::to_string(row);
+    }
+    offsets[i + 1] = std::int32_t(chars.size());
+  }
+
+  // Buffers as (offset, length) pairs, each one padded to 8 bytes
+  std::int64_t fixed = 8 * length;
+  std::vector<std::int64_t> sizes = {
+    0, fixed,                                     // id
+    0, fixed,                                     // value
+    std::int64_t(validity.size()),                // name
+    std::int64_t(4 * offsets.size()),
+    std::int64_t(chars.size())
+  };
+  std::vector<std::int64_t> buffers;
+  std::int64_t body_size = 0;
+  for (std::int64_t size : sizes) {
+    buffers.push_back(body_size);
+    buffers.push_back(size);
+    body_size += std::int64_t(arrow_ipc::pad8(std::size_t(size)));
+  }
+  std::vector<std::int64_t> nodes = {length, 0, length, 0, length, nulls};
+
+  Builder builder;
+  std::vector<std::size_t> fields;
+  std::size_t message = builder.AddTable({
+    Builder::Value<std::int16_t>(arrow_ipc::message_version,
+                                 mock_metadata_version),
+    Builder::Value<std::uint8_t>(arrow_ipc::message_header_type,
+                                 arrow_ipc::header_record_batch),
+    Builder::Offset(arrow_ipc::message_header),
+    Builder::Value<std::int64_t>(arrow_ipc::message_body_length, body_size)
+  }, &fields);
+  builder.SetRoot(message);
+  std::size_t header_field = fields[2];
+  std::size_t batch = builder.AddTable({
+    Builder::Value<std::int64_t>(arrow_ipc::record_batch_length, length),
+    Builder::Offset(arrow_ipc::record_batch_nodes),
+    Builder::Offset(arrow_ipc::record_batch_buffers)
+  }, &fields);
+  builder.Patch(header_field, batch);
+  builder.Patch(fields[1], builder.AddVector(nodes.data(), 3, 16));
+  builder.Patch(fields[2], builder.AddVector(buffers.data(), 7, 16));
+
+  std::string out;
+  std::size_t body_start = arrow_ipc::frame_message(builder.buffer(),
+                                                    std::size_t(body_size),
+                                                    &out);
+  char* body = &out[body_start];
+  std::int64_t* id = reinterpret_cast<std::int64_t*>(body + buffers[2]);
+  double* value = reinterpret_cast<double*>(body + buffers[6]);
+  for (std::int64_t i = 0; i < length; i++) {
+    id[i] = first + i;
+    value[i] = double(first + i) / 2;
+  }
+  std::memcpy(body + buffers[8], validity.data(), validity.size());
+  std::memcpy(body + buffers[10], offsets.data(), 4 * offsets.size());
+  std::memcpy(body + buffers[12], chars.data(), chars.size());
+  return out;
+}
+
+// -- Mock service -------------------------------------------------------------
+
+struct MockOptions {
+  int streams;
+  std::int64_t rows;
+  std::int64_t page_rows;
+  double latency_ms;
+  double throttle_percent;
+  int errors;
+  grpc::StatusCode error_code;
+};
+
+// Streams are named "<session>/streams/<first>-<end>" after the rows they
+// serve, so reads can resume at any offset and streams split anywhere.
+// Every response waits latency_ms, stretched by throttle_percent, and the
+// first errors reads after their first page fail with error_code.
+class MockBigQueryRead final : public BigQueryRead::Service {
+public:
+  explicit MockBigQueryRead(const MockOptions& options)
+    : options_(options), schema_(mock_schema()), errors_(options.errors),
+      sessions_(0) {}
+
+  grpc::Status CreateReadSession(grpc::ServerContext* context,
+                                 const CreateReadSessionRequest* request,
+                                 ReadSession* response) override {
+    Delay();
+    std::int64_t streams = options_.streams;
+    if (request->max_stream_count() > 0) {
+      streams = std::min<std::int64_t>(streams, request->max_stream_count());
+    }
+    streams = std::min(streams, options_.rows);
+    response->set_name(request->parent() + "/locations/mock/sessions/" +
+                       std::to_string(++sessions_));
+    response->set_table(request->read_session().table());
+    response->set_data_format(DataFormat::ARROW);
+    response->mutable_arrow_schema()->set_serialized_schema(schema_);
+    response->set_estimated_row_count(options_.rows);
+    response->set_estimated_total_bytes_scanned(options_.rows * mock_row_bytes);
+    for (std::int64_t i = 0; i < streams; i++) {
+      response->add_streams()->set_name(StreamName(
+        response->name(),
+        options_.rows * i / streams,
+        options_.rows * (i + 1) / streams));
+    }
+    return grpc::Status::OK;
+  }
+
+  grpc::Status ReadRows(grpc::ServerContext* context,
+                        const ReadRowsRequest* request,
+                        grpc::ServerWriter<ReadRowsResponse>* writer) override {
+    std::string session;
+    std::int64_t first, end;
+    if (!ParseStream(request->read_stream(), &session, &first, &end)) {
+      return grpc::Status(grpc::StatusCode::NOT_FOUND, "Unknown read stream.");
+    }
+    if (request->offset() < 0 || first + request->offset() > end) {
+      return grpc::Status(grpc::StatusCode::OUT_OF_RANGE,
+                          "Offset is past the end of the read stream.");
+    }
+    bool sent = false;
+    for (std::int64_t row = first + request->offset(); row < end;
+         row += options_.page_rows) {
+      if (context->IsCancelled()) {
+        return grpc::Status::CANCELLED;
+      }
+      Delay();
+      if (sent && InjectError()) {
+        return grpc::Status(options_.error_code, "Injected error.");
+      }
+      std::int64_t length = std::min(options_.page_rows, end - row);
+      ReadRowsResponse response;
+      response.set_row_count(length);
+      response.mutable_arrow_record_batch()->set_serialized_record_batch(
+        mock_record_batch(row, length));
+      response.mutable_stats()->mutable_progress()->set_at_response_start(
+        double(row - first) / double(end - first));
+      response.mutable_stats()->mutable_progress()->set_at_response_end(
+        double(row + length - first) / double(end - first));
+      response.mutable_throttle_state()->set_throttle_percent(
+        std::int32_t(options_.throttle_percent));
+      if (!writer->Write(response)) {
+        return grpc::Status::CANCELLED;
+      }
+      sent = true;
+    }
+    return grpc::Status::OK;
+  }
+
+  // Splits on page boundaries, the way storage blocks bound real splits.
+  // An empty response means the stream cannot be split.
+  grpc::Status SplitReadStream(grpc::ServerContext* context,
+                               const SplitReadStreamRequest* request,
+                               SplitReadStreamResponse* response) override {
+    Delay();
+    std::string session;
+    std::int64_t first, end;
+    if (!ParseStream(request->name(), &session, &first, &end)) {
+      return grpc::Status(grpc::StatusCode::NOT_FOUND, "Unknown read stream.");
+    }
+    std::int64_t split = std::int64_t(double(end - first) * request->fraction());
+    split = first + split / options_.page_rows * options_.page_rows;
+    if (split > first && split < end) {
+      response->mutable_primary_stream()->set_name(
+        StreamName(session, first, split));
+      response->mutable_remainder_stream()->set_name(
+        StreamName(session, split, end));
+    }
+    return grpc::Status::OK;
+  }
+
+private:
+  static std::string StreamName(const std::string& session,
+                                std::int64_t first, std::int64_t end) {
+    return session + "/streams/" + std::to_string(first) + "-" +
+      std::to_string(end);
+  }
+
+  static bool ParseStream(const std::string& name, std::string* session,
+                          std::int64_t* first, std::int64_t* end) {
+    std::size_t pos = name.rfind("/streams/");
+    if (pos == std::string::npos) {
+      return false;
+    }
+    *session = name.substr(0, pos);
+    long long a, b;
+    if (std::sscanf(name.c_str() + pos + 9, "%lld-%lld", &a, &b) != 2 ||
+        a < 0 || b < a) {
+      return false;
+    }
+    *first = a;
+    *end = b;
+    return true;
+  }
+
+  void Delay() const {
+    double ms = options_.latency_ms * 100 / (100 - options_.throttle_percent);
+    if (ms > 0) {
+      std::this_thread::sleep_for(std::chrono::duration<double, std::milli>(ms));
+    }
+  }
+
+  bool InjectError() {
+    int left = errors_.load();
+    while (left > 0 && !errors_.compare_exchange_weak(left, left - 1)) {}
+    return left > 0;
+  }
+
+  MockOptions options_;
+  std::string schema_;
+  std::atomic<int> errors_;
+  std::atomic<int> sessions_;
+};
+
+class MockServer {
+public:
+  explicit MockServer(const MockOptions& options) : service_(options), port_(0) {
+    grpc::ServerBuilder builder;
+    builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(),
+                             &port_);
+    builder.RegisterService(&service_);
+    server_ = builder.BuildAndStart();
+  }
+  ~MockServer() {
+    if (server_) {
+      server_->Shutdown(std::chrono::system_clock::now());
+    }
+  }
+
+  bool started() const { return server_ && port_ > 0; }
+  std::string target() const { return "127.0.0.1:" + std::to_string(port_); }
+
+private:
+  MockBigQueryRead service_;
+  int port_;
+  std::unique_ptr<grpc::Server> server_;
+};
+
+grpc::StatusCode mock_status_code(const std::string& name) {
+  const char* names[] = {
+    "OK", "CANCELLED", "UNKNOWN", "INVALID_ARGUMENT", "DEADLINE_EXCEEDED",
+    "NOT_FOUND", "ALREADY_EXISTS", "PERMISSION_DENIED", "RESOURCE_EXHAUSTED",
+    "FAILED_PRECONDITION", "ABORTED", "OUT_OF_RANGE", "UNIMPLEMENTED",
+    "INTERNAL", "UNAVAILABLE", "DATA_LOSS", "UNAUTHENTICATED"
+  };
+  for (int code = 1; code <= 16; code++) {
+    if (name == names[code]) {
+      return grpc::StatusCode(code);
+    }
+  }
+  std::string err = "Unknown gRPC status code `" + name + "`.";
+  Rcpp::stop(err.c_str());
+}
+
+// -- Mock functions -----------------------------------------------------------
+
+// [[Rcpp::export(rng=false)]]
+SEXP bqs_mock_server(int streams = 4,
+                     std::int64_t rows = 1000000,
+                     std::int64_t page_rows = 10000,
+                     double latency_ms = 0,
+                     double throttle_percent = 0,
+                     int errors = 0,
+                     std::string error_code = "UNAVAILABLE") {
+  if (streams < 1 || rows < 0 || page_rows < 1 || latency_ms < 0 ||
+      throttle_percent < 0 || throttle_percent >= 100 || errors < 0) {
+    Rcpp::stop("Invalid mock server options.");
+  }
+  MockOptions options = {
+    streams, rows, page_rows, latency_ms, throttle_percent, errors,
+    mock_status_code(error_code)
+  };
+  MockServer* server = new MockServer(options);
+  if (!server->started()) {
+    delete server;
+    Rcpp::stop("Could not start mock server.");
+  }
+  Rcpp::XPtr<MockServer> ptr(server, true);
+  ptr.attr("target") = server->target();
+  return ptr;
+}
+
+// [[Rcpp::export(rng=false)]]
+void bqs_mock_stop(SEXP server) {
+  Rcpp::XPtr<MockServer> ptr(server);
+  ptr.release();
+}
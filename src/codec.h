@@ -0,0 +1,120 @@
+/* -*- mode: c++ -*- */
+
+// Decompression codecs used by the BigQuery Storage API. Each codec is only
+// available when the package was configured with the matching library.
+
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+#ifdef BQS_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#ifdef BQS_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace codec {
+
+enum Codec { none, lz4_frame, zstd };
+
+inline bool available(Codec codec) {
+  switch (codec) {
+  case none:
+    return true;
+  case lz4_frame:
+#ifdef BQS_WITH_LZ4
+    return true;
+#else
+    return false;
+#endif
+  case zstd:
+#ifdef BQS_WITH_ZSTD
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+inline const char* name(Codec codec) {
+  switch (codec) {
+  case lz4_frame:
+    return "lz4";
+  case zstd:
+    return "zstd";
+  default:
+    return "none";
+  }
+}
+
+// Decompress src into exactly dst_size bytes at dst
+inline void decompress(Codec codec,
+                       const std::uint8_t* src, std::size_t src_size,
+                       std::uint8_t* dst, std::size_t dst_size) {
+  if (dst_size == 0) {
+    return;
+  }
+  std::string err;
+  switch (codec) {
+  case lz4_frame: {
+#ifdef BQS_WITH_LZ4
+    LZ4F_dctx* ctx;
+    LZ4F_errorCode_t code = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
+    if (LZ4F_isError(code)) {
+      err = LZ4F_getErrorName(code);
+      break;
+    }
+    std::size_t written = 0, read = 0;
+    std::size_t ret = 1;
+    while (ret != 0 && read < src_size && written < dst_size) {
+      std::size_t dst_chunk = dst_size - written;
+      std::size_t src_chunk = src_size - read;
+      ret = LZ4F_decompress(ctx, dst + written, &dst_chunk,
+                            src + read, &src_chunk, NULL);
+      if (LZ4F_isError(ret)) {
+        err = LZ4F_getErrorName(ret);
+        break;
+      }
+      written += dst_chunk;
+      read += src_chunk;
+    }
+    LZ4F_freeDecompressionContext(ctx);
+    if (err.empty() && (written != dst_size || ret != 0)) {
+      err = "unexpected decompressed size";
+    }
+#else
+    err = "not available in this build";
+#endif
+    break;
+  }
+  case zstd: {
+#ifdef BQS_WITH_ZSTD
+    std::size_t ret = ZSTD_decompress(dst, dst_size, src, src_size);
+    if (ZSTD_isError(ret)) {
+      err = ZSTD_getErrorName(ret);
+    } else if (ret != dst_size) {
+      err = "unexpected decompressed size";
+    }
+#else
+    err = "not available in this build";
+#endif
+    break;
+  }
+  default:
+    err = "unknown codec";
+  }
+  if (!err.empty()) {
+    throw std::runtime_error(
+      std::string("Could not decompress ") + name(codec) + " data: " + err);
+  }
+}
+
+} // namespace codec
+
+#endif
@@ -0,0 +1,146 @@
+/* -*- mode: c++ -*- */
+
+// Conversion kernels from Arrow fixed width buffers to R vectors. Loops are
+// kept branch free where possible so compilers can vectorize them; nulls are
+// applied afterwards from the validity bitmap.
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace kernels {
+
+// R's NA_integer_ and bit64's NA_integer64_
+const int na_int32 = INT32_MIN;
+const std::int64_t na_int64 = INT64_MIN;
+
+inline bool valid(const std::uint8_t* validity, std::int64_t i) {
+  return validity == NULL || (validity[i >> 3] >> (i & 7)) & 1;
+}
+
+// -- INT64 --------------------------------------------------------------------
+
+// Values outside of R's integer range become NA. Returns the number of them.
+inline std::int64_t int64_to_int32(const std::int64_t* src, std::int64_t n,
+                                   int* dst) {
+  std::int64_t overflow = 0;
+  for (std::int64_t i = 0; i < n; i++) {
+    std::int64_t v = src[i];
+    bool fits = v > INT32_MIN && v <= INT32_MAX;
+    dst[i] = fits ? int(v) : na_int32;
+    overflow += !fits;
+  }
+  return overflow;
+}
+
+// Returns the number of values not exactly representable as double
+inline std::int64_t int64_to_double(const std::int64_t* src, std::int64_t n,
+                                    double* dst) {
+  const std::int64_t exact = std::int64_t(1) << 53;
+  std::int64_t inexact = 0;
+  for (std::int64_t i = 0; i < n; i++) {
+    std::int64_t v = src[i];
+    dst[i] = double(v);
+    inexact += v > exact || v < -exact;
+  }
+  return inexact;
+}
+
+// -- Decimals -----------------------------------------------------------------
+
+// Decimal128 and Decimal256 values are little-endian two's complement
+// integers of 2 or 4 64-bit words, scaled by 10^scale.
+inline double decimal_unscaled(const std::uint8_t* value, int words) {
+  std::uint64_t word[4];
+  std::memcpy(word, value, 8 * words);
+  // Most values fit in the lowest word, which converts with one rounding
+  bool small = true;
+  for (int w = 1; w < words; w++) {
+    small = small && std::int64_t(word[w]) == (std::int64_t(word[0]) >> 63);
+  }
+  if (small) {
+    return double(std::int64_t(word[0]));
+  }
+  // Otherwise sum the words of the magnitude, so they do not cancel out
+  bool negative = word[words - 1] >> 63;
+  if (negative) {
+    std::uint64_t carry = 1;
+    for (int w = 0; w < words; w++) {
+      word[w] = ~word[w] + carry;
+      carry = carry && word[w] == 0;
+    }
+  }
+  double out = 0;
+  for (int w = words - 1; w >= 0; w--) {
+    out = out * 18446744073709551616.0 + double(word[w]);
+  }
+  return negative ? -out : out;
+}
+
+inline void decimal_to_double(const std::uint8_t* src, std::int64_t n,
+                              int bit_width, int scale, double* dst) {
+  int words = bit_width / 64;
+  double divisor = std::pow(10.0, scale);
+  for (std::int64_t i = 0; i < n; i++) {
+    dst[i] = decimal_unscaled(src + 8 * words * i, words) / divisor;
+  }
+}
+
+// Exact decimal text of a value, without trailing fractional zeros
+inline std::string decimal_to_string(const std::uint8_t* value, int bit_width,
+                                     int scale) {
+  int limbs = bit_width / 32;
+  std::uint32_t limb[8];
+  std::memcpy(limb, value, 4 * limbs);
+  bool negative = limb[limbs - 1] >> 31;
+  if (negative) {
+    std::uint64_t carry = 1;
+    for (int l = 0; l < limbs; l++) {
+      std::uint64_t v = std::uint64_t(std::uint32_t(~limb[l])) + carry;
+      limb[l] = std::uint32_t(v);
+      carry = v >> 32;
+    }
+  }
+
+  // Digits from least significant, dividing by 10^9 at a time
+  char digits[96];
+  int count = 0;
+  int top = limbs;
+  while (top > 0 && limb[top - 1] == 0) top--;
+  while (top > 0) {
+    std::uint64_t rem = 0;
+    for (int l = top - 1; l >= 0; l--) {
+      std::uint64_t cur = (rem << 32) | limb[l];
+      limb[l] = std::uint32_t(cur / 1000000000);
+      rem = cur % 1000000000;
+    }
+    while (top > 0 && limb[top - 1] == 0) top--;
+    for (int d = 0; d < 9 && (top > 0 || rem > 0); d++) {
+      digits[count++] = char('0' + rem % 10);
+      rem /= 10;
+    }
+  }
+  while (count <= scale) {
+    digits[count++] = '0';
+  }
+
+  int low = 0;
+  while (low < scale && digits[low] == '0') low++;
+  std::string out;
+  out.reserve(count + 2);
+  if (negative) out += '-';
+  for (int d = count - 1; d >= scale; d--) out += digits[d];
+  if (low < scale) {
+    out += '.';
+    for (int d = scale - 1; d >= low; d--) out += digits[d];
+  }
+  return out;
+}
+
+} // namespace kernels
+
+#endif
@@ -0,0 +1,846 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+#include <Rcpp.h>
+#include "kernels.h"
+
+// Arrow C data interface, as passed by nanoarrow external pointers
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  const char* format;
+  const char* name;
+  const char* metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema** children;
+  struct ArrowSchema* dictionary;
+  void (*release)(struct ArrowSchema*);
+  void* private_data;
+};
+
+struct ArrowArray {
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void** buffers;
+  struct ArrowArray** children;
+  struct ArrowArray* dictionary;
+  void (*release)(struct ArrowArray*);
+  void* private_data;
+};
+
+#endif
+
+// Conversion of record batches to BigQuery R types, guided by the fields of
+// the read session schema. Top level INT64 and decimal columns and nested
+// RECORD and REPEATED columns are converted straight from the Arrow buffers,
+// with the conversion of each node resolved once per column. Other columns
+// are decoded by nanoarrow, then given their BigQuery classes in one pass.
+
+// -- Fields -------------------------------------------------------------------
+
+enum Bigint { bigint_integer, bigint_integer64, bigint_numeric, bigint_character };
+
+Bigint bigint_option(const std::string& bigint) {
+  if (bigint == "integer") return bigint_integer;
+  if (bigint == "integer64") return bigint_integer64;
+  if (bigint == "character") return bigint_character;
+  return bigint_numeric;
+}
+
+std::string field_string(SEXP field, const char* name) {
+  SEXP names = Rf_getAttrib(field, R_NamesSymbol);
+  for (R_xlen_t i = 0; i < Rf_xlength(field); i++) {
+    if (std::strcmp(CHAR(STRING_ELT(names, i)), name) == 0) {
+      SEXP value = VECTOR_ELT(field, i);
+      if (TYPEOF(value) == STRSXP && Rf_xlength(value) == 1) {
+        return CHAR(STRING_ELT(value, 0));
+      }
+    }
+  }
+  return "";
+}
+
+SEXP field_fields(SEXP field) {
+  SEXP names = Rf_getAttrib(field, R_NamesSymbol);
+  for (R_xlen_t i = 0; i < Rf_xlength(field); i++) {
+    if (std::strcmp(CHAR(STRING_ELT(names, i)), "fields") == 0) {
+      return VECTOR_ELT(field, i);
+    }
+  }
+  return R_NilValue;
+}
+
+bool is_integer_type(const std::string& type) {
+  return type == "INTEGER" || type == "INT64" || type == "INT" ||
+    type == "SMALLINT" || type == "BIGINT" || type == "TINYINT" ||
+    type == "BYTEINT";
+}
+
+// -- Leaf conversions ---------------------------------------------------------
+
+// Reports values that did not fit the target type, once per conversion
+struct Overflow {
+  bool integer = false;
+  bool integer64 = false;
+};
+
+SEXP to_integer(SEXP x, Overflow* overflow) {
+  if (TYPEOF(x) != REALSXP) {
+    return x;
+  }
+  R_xlen_t n = Rf_xlength(x);
+  SEXP out = PROTECT(Rf_allocVector(INTSXP, n));
+  const double* src = REAL(x);
+  int* dst = INTEGER(out);
+  for (R_xlen_t i = 0; i < n; i++) {
+    double v = src[i];
+    if (ISNAN(v)) {
+      dst[i] = NA_INTEGER;
+    } else if (v >= 2147483648.0 || v <= -2147483649.0 ||
+               std::trunc(v) == -2147483648.0) {
+      dst[i] = NA_INTEGER;
+      overflow->integer = true;
+    } else {
+      dst[i] = int(v);
+    }
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP to_integer64(SEXP x, Overflow* overflow) {
+  if ((TYPEOF(x) != REALSXP && TYPEOF(x) != INTSXP) ||
+      Rf_inherits(x, "integer64")) {
+    return x;
+  }
+  R_xlen_t n = Rf_xlength(x);
+  SEXP out = PROTECT(Rf_allocVector(REALSXP, n));
+  std::int64_t* dst = reinterpret_cast<std::int64_t*>(REAL(out));
+  const std::int64_t na = INT64_MIN;
+  if (TYPEOF(x) == INTSXP) {
+    const int* src = INTEGER(x);
+    for (R_xlen_t i = 0; i < n; i++) {
+      dst[i] = src[i] == NA_INTEGER ? na : std::int64_t(src[i]);
+    }
+  } else {
+    const double* src = REAL(x);
+    for (R_xlen_t i = 0; i < n; i++) {
+      double v = src[i];
+      if (ISNAN(v)) {
+        dst[i] = na;
+      } else if (v >= 9223372036854775808.0 || v <= -9223372036854775808.0) {
+        dst[i] = na;
+        overflow->integer64 = true;
+      } else {
+        dst[i] = std::int64_t(v);
+      }
+    }
+  }
+  Rf_setAttrib(out, R_ClassSymbol, Rf_mkString("integer64"));
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP to_character(SEXP x) {
+  if (TYPEOF(x) != REALSXP && TYPEOF(x) != INTSXP) {
+    return x;
+  }
+  R_xlen_t n = Rf_xlength(x);
+  SEXP out = PROTECT(Rf_allocVector(STRSXP, n));
+  char buffer[32];
+  for (R_xlen_t i = 0; i < n; i++) {
+    if (TYPEOF(x) == INTSXP) {
+      int v = INTEGER(x)[i];
+      if (v == NA_INTEGER) {
+        SET_STRING_ELT(out, i, NA_STRING);
+        continue;
+      }
+      std::snprintf(buffer, sizeof(buffer), "%d", v);
+    } else {
+      double v = REAL(x)[i];
+      if (ISNAN(v)) {
+        SET_STRING_ELT(out, i, NA_STRING);
+        continue;
+      }
+      std::snprintf(buffer, sizeof(buffer), "%.0f", std::trunc(v));
+    }
+    SET_STRING_ELT(out, i, Rf_mkCharCE(buffer, CE_UTF8));
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP set_class(SEXP x, std::initializer_list<const char*> classes) {
+  SEXP cls = PROTECT(Rf_allocVector(STRSXP, classes.size()));
+  R_xlen_t i = 0;
+  for (const char* name : classes) {
+    SET_STRING_ELT(cls, i++, Rf_mkChar(name));
+  }
+  Rf_setAttrib(x, R_ClassSymbol, cls);
+  UNPROTECT(1);
+  return x;
+}
+
+// -- Column walk --------------------------------------------------------------
+
+struct Postprocess {
+  Bigint bigint;
+  Overflow overflow;
+
+  // Convert a column of a single value per row
+  SEXP Value(SEXP x, const std::string& type, SEXP field) {
+    if (type == "RECORD") {
+      return Record(x, field_fields(field));
+    }
+    if (is_integer_type(type)) {
+      switch (bigint) {
+      case bigint_integer:
+        return to_integer(x, &overflow);
+      case bigint_integer64:
+        return to_integer64(x, &overflow);
+      case bigint_character:
+        return to_character(x);
+      default:
+        return x;
+      }
+    }
+    if (type == "DATETIME" && TYPEOF(x) == REALSXP) {
+      Rf_setAttrib(x, Rf_install("tzone"), Rf_mkString("UTC"));
+    } else if (type == "GEOGRAPHY" && TYPEOF(x) == STRSXP) {
+      set_class(x, {"wk_wkt", "wk_vctr"});
+    } else if (type == "BYTES" && TYPEOF(x) == VECSXP) {
+      set_class(x, {"blob", "vctrs_list_of", "vctrs_vctr", "list"});
+      Rf_setAttrib(x, Rf_install("ptype"), Rf_allocVector(RAWSXP, 0));
+    }
+    return x;
+  }
+
+  // Convert a column, one vector per row when the field is REPEATED
+  SEXP Column(SEXP x, SEXP field) {
+    std::string type = field_string(field, "type");
+    if (field_string(field, "mode") != "REPEATED" || TYPEOF(x) != VECSXP) {
+      return Value(x, type, field);
+    }
+    // Plain list of the values of each row, as as.list() would return
+    Rf_setAttrib(x, R_ClassSymbol, R_NilValue);
+    Rf_setAttrib(x, Rf_install("ptype"), R_NilValue);
+    for (R_xlen_t i = 0; i < Rf_xlength(x); i++) {
+      SEXP value = VECTOR_ELT(x, i);
+      if (value != R_NilValue) {
+        SET_VECTOR_ELT(x, i, Value(value, type, field));
+      }
+    }
+    return x;
+  }
+
+  // Convert the columns of a data frame, matched to fields by position
+  SEXP Record(SEXP x, SEXP fields) {
+    if (TYPEOF(x) != VECSXP || TYPEOF(fields) != VECSXP) {
+      return x;
+    }
+    R_xlen_t n = std::min(Rf_xlength(x), Rf_xlength(fields));
+    for (R_xlen_t i = 0; i < n; i++) {
+      SET_VECTOR_ELT(x, i, Column(VECTOR_ELT(x, i), VECTOR_ELT(fields, i)));
+    }
+    if (Rf_inherits(x, "data.frame") && !Rf_inherits(x, "tbl_df")) {
+      set_class(x, {"tbl_df", "tbl", "data.frame"});
+    }
+    return x;
+  }
+};
+
+// Convert the columns of a data frame freshly decoded by nanoarrow in place
+// [[Rcpp::export(rng=false)]]
+SEXP bqs_postprocess(SEXP df, SEXP fields, std::string bigint) {
+  Postprocess postprocess;
+  postprocess.bigint = bigint_option(bigint);
+  postprocess.Record(df, fields);
+  if (postprocess.overflow.integer) {
+    Rcpp::warning("NAs introduced by coercion to integer range");
+  }
+  if (postprocess.overflow.integer64) {
+    Rcpp::warning("NAs produced by integer64 overflow");
+  }
+  return df;
+}
+
+// -- Arrow columns ------------------------------------------------------------
+
+enum Decimal { decimal_numeric, decimal_character };
+
+// Top level column of the record batches of a stream, one chunk per batch
+struct ArrowColumn {
+  std::vector<const ArrowArray*> chunks;
+  std::vector<std::int64_t> offsets;
+  std::vector<std::int64_t> lengths;
+  std::int64_t length = 0;
+
+  // Values of a chunk, width bytes each
+  const std::uint8_t* Data(std::size_t c, int width) const {
+    return static_cast<const std::uint8_t*>(chunks[c]->buffers[1]) +
+      width * offsets[c];
+  }
+
+  bool Valid(std::size_t c, std::int64_t i) const {
+    return kernels::valid(
+      static_cast<const std::uint8_t*>(chunks[c]->buffers[0]), offsets[c] + i);
+  }
+
+  // Call f(i) for each null value, i being its position in the column
+  template <typename F>
+  void Nulls(F f) const {
+    std::int64_t pos = 0;
+    for (std::size_t c = 0; c < chunks.size(); c++) {
+      if (chunks[c]->buffers[0] != NULL && chunks[c]->null_count != 0) {
+        for (std::int64_t i = 0; i < lengths[c]; i++) {
+          if (!Valid(c, i)) {
+            f(pos + i);
+          }
+        }
+      }
+      pos += lengths[c];
+    }
+  }
+};
+
+SEXP int64_column(const ArrowColumn& column, Bigint bigint,
+                  Overflow* overflow, bool* inexact) {
+  std::int64_t pos = 0;
+  SEXP out = R_NilValue;
+  switch (bigint) {
+  case bigint_integer: {
+    out = PROTECT(Rf_allocVector(INTSXP, column.length));
+    int* dst = INTEGER(out);
+    std::int64_t overflows = 0;
+    for (std::size_t c = 0; c < column.chunks.size(); c++) {
+      overflows += kernels::int64_to_int32(
+        reinterpret_cast<const std::int64_t*>(column.Data(c, 8)),
+        column.lengths[c], dst + pos);
+      pos += column.lengths[c];
+    }
+    // Values under nulls are undefined, do not count them as overflows
+    column.Nulls([&](std::int64_t i) {
+      overflows -= dst[i] == kernels::na_int32;
+      dst[i] = kernels::na_int32;
+    });
+    overflow->integer = overflow->integer || overflows > 0;
+    break;
+  }
+  case bigint_integer64: {
+    out = PROTECT(Rf_allocVector(REALSXP, column.length));
+    std::int64_t* dst = reinterpret_cast<std::int64_t*>(REAL(out));
+    for (std::size_t c = 0; c < column.chunks.size(); c++) {
+      std::memcpy(dst + pos, column.Data(c, 8), 8 * column.lengths[c]);
+      pos += column.lengths[c];
+    }
+    column.Nulls([&](std::int64_t i) { dst[i] = kernels::na_int64; });
+    Rf_setAttrib(out, R_ClassSymbol, Rf_mkString("integer64"));
+    break;
+  }
+  case bigint_numeric: {
+    out = PROTECT(Rf_allocVector(REALSXP, column.length));
+    double* dst = REAL(out);
+    std::int64_t count = 0;
+    for (std::size_t c = 0; c < column.chunks.size(); c++) {
+      count += kernels::int64_to_double(
+        reinterpret_cast<const std::int64_t*>(column.Data(c, 8)),
+        column.lengths[c], dst + pos);
+      pos += column.lengths[c];
+    }
+    column.Nulls([&](std::int64_t i) {
+      count -= std::fabs(dst[i]) > 9007199254740992.0;
+      dst[i] = NA_REAL;
+    });
+    *inexact = *inexact || count > 0;
+    break;
+  }
+  case bigint_character: {
+    out = PROTECT(Rf_allocVector(STRSXP, column.length));
+    char buffer[24];
+    for (std::size_t c = 0; c < column.chunks.size(); c++) {
+      const std::int64_t* src =
+        reinterpret_cast<const std::int64_t*>(column.Data(c, 8));
+      for (std::int64_t i = 0; i < column.lengths[c]; i++) {
+        if (!column.Valid(c, i)) {
+          SET_STRING_ELT(out, pos + i, NA_STRING);
+          continue;
+        }
+        std::snprintf(buffer, sizeof(buffer), "%lld", (long long) src[i]);
+        SET_STRING_ELT(out, pos + i, Rf_mkCharCE(buffer, CE_UTF8));
+      }
+      pos += column.lengths[c];
+    }
+    break;
+  }
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+SEXP decimal_column(const ArrowColumn& column, int bit_width, int scale,
+                    Decimal decimal) {
+  std::int64_t pos = 0;
+  int width = bit_width / 8;
+  SEXP out = R_NilValue;
+  if (decimal == decimal_numeric) {
+    out = PROTECT(Rf_allocVector(REALSXP, column.length));
+    double* dst = REAL(out);
+    for (std::size_t c = 0; c < column.chunks.size(); c++) {
+      kernels::decimal_to_double(column.Data(c, width), column.lengths[c],
+                                 bit_width, scale, dst + pos);
+      pos += column.lengths[c];
+    }
+    column.Nulls([&](std::int64_t i) { dst[i] = NA_REAL; });
+  } else {
+    out = PROTECT(Rf_allocVector(STRSXP, column.length));
+    for (std::size_t c = 0; c < column.chunks.size(); c++) {
+      const std::uint8_t* src = column.Data(c, width);
+      for (std::int64_t i = 0; i < column.lengths[c]; i++) {
+        if (!column.Valid(c, i)) {
+          SET_STRING_ELT(out, pos + i, NA_STRING);
+          continue;
+        }
+        std::string text =
+          kernels::decimal_to_string(src + width * i, bit_width, scale);
+        SET_STRING_ELT(out, pos + i,
+                       Rf_mkCharLenCE(text.data(), text.size(), CE_UTF8));
+      }
+      pos += column.lengths[c];
+    }
+  }
+  UNPROTECT(1);
+  return out;
+}
+
+// -- Nested columns -----------------------------------------------------------
+
+enum NodeKind {
+  node_bool, node_int64, node_double, node_string, node_binary, node_decimal,
+  node_date, node_timestamp, node_struct, node_list
+};
+
+// Conversion of a node of a nested column, resolved once per column from its
+// Arrow format and BigQuery field. Lists are REPEATED fields, their single
+// child converts the values of each row.
+struct Node {
+  NodeKind kind = node_struct;
+  std::string name;
+  std::string type;
+  int bit_width = 128;
+  int scale = 0;
+  double units = 1;
+  bool large = false;
+  std::string tzone;
+  std::vector<Node> children;
+};
+
+// Plan the conversion of a column. Returns false when a node has a layout
+// left to nanoarrow.
+bool plan_node(const ArrowSchema* schema, SEXP field, Node* node) {
+  if (schema->dictionary != NULL) {
+    return false;
+  }
+  std::string format = schema->format;
+  node->name = schema->name == NULL ? "" : schema->name;
+  node->type = field == R_NilValue ? "" : field_string(field, "type");
+  int precision = 0;
+  if (format == "+s") {
+    node->kind = node_struct;
+    SEXP fields = field == R_NilValue ? R_NilValue : field_fields(field);
+    for (std::int64_t k = 0; k < schema->n_children; k++) {
+      SEXP child = TYPEOF(fields) == VECSXP && k < Rf_xlength(fields) ?
+        VECTOR_ELT(fields, k) : R_NilValue;
+      node->children.push_back(Node());
+      if (!plan_node(schema->children[k], child, &node->children.back())) {
+        return false;
+      }
+    }
+  } else if (format == "+l" || format == "+L") {
+    node->kind = node_list;
+    node->large = format == "+L";
+    node->children.push_back(Node());
+    return schema->n_children == 1 &&
+      plan_node(schema->children[0], field, &node->children.back());
+  } else if (format == "b") {
+    node->kind = node_bool;
+  } else if (format == "l") {
+    node->kind = node_int64;
+  } else if (format == "g") {
+    node->kind = node_double;
+  } else if (format == "u") {
+    node->kind = node_string;
+  } else if (format == "z") {
+    node->kind = node_binary;
+  } else if (format == "tdD") {
+    node->kind = node_date;
+  } else if (format.size() >= 4 && format.compare(0, 2, "ts") == 0 &&
+             format[3] == ':') {
+    node->kind = node_timestamp;
+    const char* units = std::strchr("smun", format[2]);
+    if (units == NULL) {
+      return false;
+    }
+    node->units = std::pow(1000.0, double(units - "smun"));
+    // DATETIME has no time zone, and is read as UTC
+    node->tzone = format.size() > 4 ? format.substr(4) : "UTC";
+  } else if (format.compare(0, 2, "d:") == 0 &&
+             std::sscanf(format.c_str(), "d:%d,%d,%d", &precision,
+                         &node->scale, &node->bit_width) >= 2 &&
+             (node->bit_width == 128 || node->bit_width == 256)) {
+    node->kind = node_decimal;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+struct NestedConverter {
+  Bigint bigint;
+  Decimal decimal;
+  Overflow overflow;
+  bool inexact = false;
+
+  // Allocate the R vector of n values of a node, with its classes
+  SEXP Alloc(const Node& node, R_xlen_t n) {
+    SEXP out = R_NilValue;
+    switch (node.kind) {
+    case node_bool:
+      return Rf_allocVector(LGLSXP, n);
+    case node_int64:
+      switch (bigint) {
+      case bigint_integer:
+        return Rf_allocVector(INTSXP, n);
+      case bigint_character:
+        return Rf_allocVector(STRSXP, n);
+      case bigint_integer64:
+        out = PROTECT(Rf_allocVector(REALSXP, n));
+        Rf_setAttrib(out, R_ClassSymbol, Rf_mkString("integer64"));
+        UNPROTECT(1);
+        return out;
+      default:
+        return Rf_allocVector(REALSXP, n);
+      }
+    case node_double:
+      return Rf_allocVector(REALSXP, n);
+    case node_string:
+      out = PROTECT(Rf_allocVector(STRSXP, n));
+      if (node.type == "GEOGRAPHY") {
+        set_class(out, {"wk_wkt", "wk_vctr"});
+      }
+      UNPROTECT(1);
+      return out;
+    case node_binary:
+      out = PROTECT(Rf_allocVector(VECSXP, n));
+      set_class(out, {"blob", "vctrs_list_of", "vctrs_vctr", "list"});
+      Rf_setAttrib(out, Rf_install("ptype"), Rf_allocVector(RAWSXP, 0));
+      UNPROTECT(1);
+      return out;
+    case node_decimal:
+      return Rf_allocVector(decimal == decimal_character ? STRSXP : REALSXP,
+                            n);
+    case node_date:
+      out = PROTECT(Rf_allocVector(REALSXP, n));
+      Rf_setAttrib(out, R_ClassSymbol, Rf_mkString("Date"));
+      UNPROTECT(1);
+      return out;
+    case node_timestamp:
+      out = PROTECT(Rf_allocVector(REALSXP, n));
+      set_class(out, {"POSIXct", "POSIXt"});
+      Rf_setAttrib(out, Rf_install("tzone"), Rf_mkString(node.tzone.c_str()));
+      UNPROTECT(1);
+      return out;
+    case node_list:
+      return Rf_allocVector(VECSXP, n);
+    case node_struct:
+      break;
+    }
+    out = PROTECT(Rf_allocVector(VECSXP, node.children.size()));
+    SEXP names = PROTECT(Rf_allocVector(STRSXP, node.children.size()));
+    for (std::size_t k = 0; k < node.children.size(); k++) {
+      SET_STRING_ELT(names, k,
+                     Rf_mkCharCE(node.children[k].name.c_str(), CE_UTF8));
+      SET_VECTOR_ELT(out, k, Alloc(node.children[k], n));
+    }
+    Rf_setAttrib(out, R_NamesSymbol, names);
+    SEXP row_names = PROTECT(Rf_allocVector(INTSXP, 2));
+    INTEGER(row_names)[0] = NA_INTEGER;
+    INTEGER(row_names)[1] = -int(n);
+    Rf_setAttrib(out, R_RowNamesSymbol, row_names);
+    set_class(out, {"tbl_df", "tbl", "data.frame"});
+    UNPROTECT(3);
+    return out;
+  }
+
+  // Convert n rows of array from row to out, starting at pos. Rows do not
+  // count the offset of the array.
+  void Fill(const Node& node, const ArrowArray* array, std::int64_t row,
+            std::int64_t n, SEXP out, R_xlen_t pos) {
+    if (array->length < row + n ||
+        array->n_children != std::int64_t(node.children.size())) {
+      Rcpp::stop("Record batch does not match its schema.");
+    }
+    std::int64_t start = array->offset + row;
+    const std::uint8_t* validity =
+      array->null_count == 0 ? NULL :
+      static_cast<const std::uint8_t*>(array->buffers[0]);
+    switch (node.kind) {
+    case node_struct:
+      for (std::size_t k = 0; k < node.children.size(); k++) {
+        Fill(node.children[k], array->children[k], start, n,
+             VECTOR_ELT(out, k), pos);
+      }
+      return;
+    case node_list:
+      for (std::int64_t i = 0; i < n; i++) {
+        if (!kernels::valid(validity, start + i)) {
+          SET_VECTOR_ELT(out, pos + i, R_NilValue);
+          continue;
+        }
+        std::int64_t begin, end;
+        if (node.large) {
+          const std::int64_t* offsets =
+            static_cast<const std::int64_t*>(array->buffers[1]);
+          begin = offsets[start + i];
+          end = offsets[start + i + 1];
+        } else {
+          const std::int32_t* offsets =
+            static_cast<const std::int32_t*>(array->buffers[1]);
+          begin = offsets[start + i];
+          end = offsets[start + i + 1];
+        }
+        SEXP values = PROTECT(Alloc(node.children[0], end - begin));
+        Fill(node.children[0], array->children[0], begin, end - begin,
+             values, 0);
+        SET_VECTOR_ELT(out, pos + i, values);
+        UNPROTECT(1);
+      }
+      return;
+    case node_string:
+    case node_binary:
+      for (std::int64_t i = 0; i < n; i++) {
+        if (!kernels::valid(validity, start + i)) {
+          if (node.kind == node_string) {
+            SET_STRING_ELT(out, pos + i, NA_STRING);
+          } else {
+            SET_VECTOR_ELT(out, pos + i, R_NilValue);
+          }
+          continue;
+        }
+        const std::int32_t* offsets =
+          static_cast<const std::int32_t*>(array->buffers[1]);
+        const char* data = static_cast<const char*>(array->buffers[2]);
+        std::int32_t size = offsets[start + i + 1] - offsets[start + i];
+        if (node.kind == node_string) {
+          SET_STRING_ELT(out, pos + i,
+                         Rf_mkCharLenCE(data + offsets[start + i], size,
+                                        CE_UTF8));
+        } else {
+          SEXP value = Rf_allocVector(RAWSXP, size);
+          SET_VECTOR_ELT(out, pos + i, value);
+          std::memcpy(RAW(value), data + offsets[start + i], size);
+        }
+      }
+      return;
+    default:
+      break;
+    }
+    std::int64_t lost = FillValues(node, array, start, n, out, pos);
+    for (std::int64_t i = 0; validity != NULL && i < n; i++) {
+      if (kernels::valid(validity, start + i)) {
+        continue;
+      }
+      // Values under nulls are undefined, do not count them as lost
+      switch (TYPEOF(out)) {
+      case LGLSXP:
+        LOGICAL(out)[pos + i] = NA_LOGICAL;
+        break;
+      case INTSXP:
+        lost -= INTEGER(out)[pos + i] == kernels::na_int32;
+        INTEGER(out)[pos + i] = NA_INTEGER;
+        break;
+      case STRSXP:
+        SET_STRING_ELT(out, pos + i, NA_STRING);
+        break;
+      default:
+        if (node.kind == node_int64 && bigint == bigint_integer64) {
+          reinterpret_cast<std::int64_t*>(REAL(out))[pos + i] =
+            kernels::na_int64;
+        } else {
+          lost -= node.kind == node_int64 &&
+            std::fabs(REAL(out)[pos + i]) > 9007199254740992.0;
+          REAL(out)[pos + i] = NA_REAL;
+        }
+      }
+    }
+    if (node.kind == node_int64 && lost > 0) {
+      if (bigint == bigint_integer) {
+        overflow.integer = true;
+      } else {
+        inexact = true;
+      }
+    }
+  }
+
+  // Convert the fixed width values of a leaf, nulls included. Returns the
+  // number of INT64 values out of range of integer or inexact as double.
+  std::int64_t FillValues(const Node& node, const ArrowArray* array,
+                  std::int64_t start, std::int64_t n, SEXP out, R_xlen_t pos) {
+    const std::uint8_t* data =
+      static_cast<const std::uint8_t*>(array->buffers[1]);
+    switch (node.kind) {
+    case node_bool:
+      for (std::int64_t i = 0; i < n; i++) {
+        LOGICAL(out)[pos + i] = kernels::valid(data, start + i);
+      }
+      return 0;
+    case node_double:
+      std::memcpy(REAL(out) + pos, data + 8 * start, 8 * n);
+      return 0;
+    case node_date: {
+      const std::int32_t* days = reinterpret_cast<const std::int32_t*>(data);
+      for (std::int64_t i = 0; i < n; i++) {
+        REAL(out)[pos + i] = days[start + i];
+      }
+      return 0;
+    }
+    case node_timestamp: {
+      const std::int64_t* ticks = reinterpret_cast<const std::int64_t*>(data);
+      for (std::int64_t i = 0; i < n; i++) {
+        REAL(out)[pos + i] = double(ticks[start + i]) / node.units;
+      }
+      return 0;
+    }
+    case node_decimal: {
+      int width = node.bit_width / 8;
+      if (decimal == decimal_numeric) {
+        kernels::decimal_to_double(data + width * start, n, node.bit_width,
+                                   node.scale, REAL(out) + pos);
+        return 0;
+      }
+      for (std::int64_t i = 0; i < n; i++) {
+        std::string text = kernels::decimal_to_string(
+          data + width * (start + i), node.bit_width, node.scale);
+        SET_STRING_ELT(out, pos + i,
+                       Rf_mkCharLenCE(text.data(), text.size(), CE_UTF8));
+      }
+      return 0;
+    }
+    default:
+      break;
+    }
+    const std::int64_t* src = reinterpret_cast<const std::int64_t*>(data) +
+      start;
+    switch (bigint) {
+    case bigint_integer:
+      return kernels::int64_to_int32(src, n, INTEGER(out) + pos);
+    case bigint_integer64:
+      std::memcpy(REAL(out) + pos, src, 8 * n);
+      return 0;
+    case bigint_numeric:
+      return kernels::int64_to_double(src, n, REAL(out) + pos);
+    case bigint_character: {
+      char buffer[24];
+      for (std::int64_t i = 0; i < n; i++) {
+        std::snprintf(buffer, sizeof(buffer), "%lld", (long long) src[i]);
+        SET_STRING_ELT(out, pos + i, Rf_mkCharCE(buffer, CE_UTF8));
+      }
+      return 0;
+    }
+    }
+    return 0;
+  }
+};
+
+// Convert the top level INT64 and decimal columns and the nested columns of
+// record batches, given as nanoarrow objects, matched to fields by position.
+// Other columns are left NULL, for nanoarrow.
+// [[Rcpp::export(rng=false)]]
+SEXP bqs_convert_columns(SEXP schema, SEXP batches, SEXP fields,
+                         std::string bigint, std::string decimal) {
+  const ArrowSchema* struct_schema =
+    static_cast<const ArrowSchema*>(R_ExternalPtrAddr(schema));
+  if (struct_schema == NULL || std::strcmp(struct_schema->format, "+s") != 0) {
+    Rcpp::stop("Expected a struct schema.");
+  }
+  std::int64_t n_columns = struct_schema->n_children;
+  NestedConverter converter;
+  converter.bigint = bigint_option(bigint);
+  converter.decimal =
+    decimal == "character" ? decimal_character : decimal_numeric;
+
+  SEXP out = PROTECT(Rf_allocVector(VECSXP, n_columns));
+  SEXP names = PROTECT(Rf_allocVector(STRSXP, n_columns));
+  for (std::int64_t j = 0; j < n_columns; j++) {
+    const ArrowSchema* field = struct_schema->children[j];
+    SET_STRING_ELT(names, j, Rf_mkCharCE(field->name, CE_UTF8));
+    std::string format = field->format;
+    int precision = 0, scale = 0, bit_width = 128;
+    bool is_int64 = format == "l";
+    bool is_decimal = format.compare(0, 2, "d:") == 0 &&
+      std::sscanf(format.c_str(), "d:%d,%d,%d",
+                  &precision, &scale, &bit_width) >= 2 &&
+      (bit_width == 128 || bit_width == 256);
+    SEXP bq_field = TYPEOF(fields) == VECSXP && j < Rf_xlength(fields) ?
+      VECTOR_ELT(fields, j) : R_NilValue;
+    Node node;
+    bool is_nested = (format == "+s" || format == "+l" || format == "+L") &&
+      plan_node(field, bq_field, &node);
+    if (field->dictionary != NULL || (!is_int64 && !is_decimal && !is_nested)) {
+      continue;
+    }
+
+    ArrowColumn column;
+    for (R_xlen_t b = 0; b < Rf_xlength(batches); b++) {
+      const ArrowArray* batch = static_cast<const ArrowArray*>(
+        R_ExternalPtrAddr(VECTOR_ELT(batches, b)));
+      if (batch == NULL || batch->n_children != n_columns ||
+          batch->children[j]->length < batch->offset + batch->length) {
+        Rcpp::stop("Record batch does not match its schema.");
+      }
+      column.chunks.push_back(batch->children[j]);
+      column.offsets.push_back(batch->offset + batch->children[j]->offset);
+      column.lengths.push_back(batch->length);
+      column.length += batch->length;
+    }
+    if (is_nested) {
+      SET_VECTOR_ELT(out, j, converter.Alloc(node, column.length));
+      std::int64_t pos = 0;
+      for (R_xlen_t b = 0; b < Rf_xlength(batches); b++) {
+        const ArrowArray* batch = static_cast<const ArrowArray*>(
+          R_ExternalPtrAddr(VECTOR_ELT(batches, b)));
+        converter.Fill(node, batch->children[j], batch->offset, batch->length,
+                       VECTOR_ELT(out, j), pos);
+        pos += batch->length;
+      }
+    } else {
+      SET_VECTOR_ELT(out, j, is_int64 ?
+        int64_column(column, converter.bigint, &converter.overflow,
+                     &converter.inexact) :
+        decimal_column(column, bit_width, scale, converter.decimal));
+    }
+  }
+  Rf_setAttrib(out, R_NamesSymbol, names);
+
+  if (converter.overflow.integer) {
+    Rcpp::warning("NAs introduced by coercion to integer range");
+  }
+  if (converter.inexact) {
+    Rcpp::warning("loss of precision in conversion to double");
+  }
+  UNPROTECT(2);
+  return out;
+}